@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "userapp.h"
+#include "mp1_snapshot.h"
+
+/*
+ * benchmark - scaling and overhead benchmark of the mp1 module
+ *
+ * forks up to max_pids children in steps of step, busy_percent of them spin
+ * on the CPU and the rest sleep in pause(). after each step it reports:
+ *   write   latency of registering one PID with write() on /proc/mp1/status
+ *   read    latency of reading the whole /proc/mp1/status
+ *   pass    wall time of the last mp1_work_function pass, from the snapshot header
+ * at the end the busy children are stopped and reaped with wait4(), and the
+ * cpu_use reported by the module is compared with their getrusage() time.
+ */
+
+#define STATUS_FILE "/proc/mp1/status"
+#define SNAPSHOT_FILE "/proc/mp1/snapshot"
+#define ACCOUNTING_PARAM "/sys/module/mp1/parameters/accounting"
+
+struct latency {
+	uint64_t total_ns;
+	uint64_t max_ns;
+	unsigned long count;
+};
+
+static pid_t * children = NULL;
+static int * busy = NULL;
+static int nr_children = 0;
+static char * snapshot_buf = NULL;
+static size_t snapshot_size = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void latency_add(struct latency * l, uint64_t ns)
+{
+	l->total_ns += ns;
+	if (ns > l->max_ns) l->max_ns = ns;
+	l->count++;
+}
+
+static double latency_avg_us(struct latency * l)
+{
+	return l->count ? (double)l->total_ns / l->count / 1000.0 : 0.0;
+}
+
+static void kill_children(void)
+{
+	int i;
+	for (i = 0; i < nr_children; i++) {
+		kill(children[i], SIGKILL);
+	}
+	while (wait(NULL) > 0)
+		;
+	nr_children = 0;
+}
+
+static pid_t spawn(int spin)
+{
+	volatile unsigned long x = 0;
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	/* note: never outlive the benchmark */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (spin) {
+		for (;;) x++;
+	}
+	for (;;) pause();
+}
+
+/* note: a buffer for the whole snapshot table, the header tells how large it can get */
+static int alloc_snapshot(int fd)
+{
+	struct mp1_snapshot_header header;
+	if (pread(fd, &header, sizeof(header), 0) < (ssize_t)sizeof(header)) return -1;
+	snapshot_size = MP1_SNAPSHOT_BYTES(header.max_records);
+	snapshot_buf = malloc(snapshot_size);
+	return snapshot_buf == NULL ? -1 : 0;
+}
+
+/* note: wait for the next sampling pass and return the snapshot it published */
+static struct mp1_snapshot_header * next_snapshot(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, -1) < 0) return NULL;
+	/* note: reading the snapshot re-arms poll() */
+	if (pread(fd, snapshot_buf, snapshot_size, 0) < 0) return NULL;
+	return (struct mp1_snapshot_header *)snapshot_buf;
+}
+
+static struct mp1_record * find_record(struct mp1_snapshot_header * header, pid_t pid)
+{
+	struct mp1_record * record;
+	__u32 i;
+	for (i = 0; i < header->nr_records; i++) {
+		record = (struct mp1_record *)(snapshot_buf + header->header_size + i * header->record_size);
+		if (record->pid == pid) return record;
+	}
+	return NULL;
+}
+
+static int read_accounting(void)
+{
+	FILE * fp = fopen(ACCOUNTING_PARAM, "r");
+	int accounting = 0;
+	if (fp == NULL) return 0;
+	if (fscanf(fp, "%d", &accounting) != 1) accounting = 0;
+	fclose(fp);
+	return accounting;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-n max_pids] [-s step] [-b busy_percent] [-r read_repeat] [-z kernel_hz]\n", name);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	int max_pids = 4096, step = 512, busy_percent = 50, read_repeat = 10, kernel_hz = 250;
+	int status_fd, snapshot_fd, opt, i, n, len, accounting;
+	char buf[64];
+	static char read_buf[1 << 16];
+	struct latency write_lat, read_lat;
+	struct mp1_snapshot_header * header;
+	struct mp1_record * record;
+	uint64_t start;
+	ssize_t ret;
+
+	while ((opt = getopt(argc, argv, "n:s:b:r:z:")) != -1) {
+		switch (opt) {
+		case 'n': max_pids = atoi(optarg); break;
+		case 's': step = atoi(optarg); break;
+		case 'b': busy_percent = atoi(optarg); break;
+		case 'r': read_repeat = atoi(optarg); break;
+		case 'z': kernel_hz = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (max_pids <= 0 || step <= 0 || busy_percent < 0 || busy_percent > 100 || read_repeat <= 0 || kernel_hz <= 0) usage(argv[0]);
+
+	children = calloc(max_pids, sizeof(pid_t));
+	busy = calloc(max_pids, sizeof(int));
+	if (children == NULL || busy == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	status_fd = open(STATUS_FILE, O_WRONLY);
+	snapshot_fd = open(SNAPSHOT_FILE, O_RDONLY);
+	if (status_fd < 0 || snapshot_fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (alloc_snapshot(snapshot_fd)) {
+		perror("snapshot");
+		return 1;
+	}
+	accounting = read_accounting();
+
+	printf("%8s %12s %12s %12s %12s %12s %10s\n",
+		"pids", "write_avg_us", "write_max_us", "read_avg_us", "read_max_us", "pass_us", "read_bytes");
+
+	/* section: grow the number of tracked PIDs step by step */
+	while (nr_children < max_pids) {
+		memset(&write_lat, 0, sizeof(write_lat));
+		memset(&read_lat, 0, sizeof(read_lat));
+
+		for (i = 0; i < step && nr_children < max_pids; i++) {
+			/* note: spread the busy children evenly over the steps */
+			busy[nr_children] = (nr_children * busy_percent / 100) != ((nr_children + 1) * busy_percent / 100);
+			children[nr_children] = spawn(busy[nr_children]);
+			if (children[nr_children] < 0) {
+				perror("fork");
+				kill_children();
+				return 1;
+			}
+			len = snprintf(buf, sizeof(buf), "%d", children[nr_children]);
+			nr_children++;
+
+			start = now_ns();
+			if (write(status_fd, buf, len) != len) {
+				perror("write");
+				kill_children();
+				return 1;
+			}
+			latency_add(&write_lat, now_ns() - start);
+		}
+
+		/* note: the first pass may have started before the last registration */
+		if (next_snapshot(snapshot_fd) == NULL || (header = next_snapshot(snapshot_fd)) == NULL) {
+			perror("snapshot");
+			kill_children();
+			return 1;
+		}
+
+		for (i = 0; i < read_repeat; i++) {
+			FILE * fp;
+			start = now_ns();
+			fp = fopen(STATUS_FILE, "r");
+			if (fp == NULL) {
+				perror("fopen");
+				kill_children();
+				return 1;
+			}
+			len = 0;
+			while ((n = fread(read_buf, 1, sizeof(read_buf), fp)) > 0) len += n;
+			fclose(fp);
+			latency_add(&read_lat, now_ns() - start);
+		}
+
+		printf("%8d %12.1f %12.1f %12.1f %12.1f %12.1f %10d\n", nr_children,
+			latency_avg_us(&write_lat), write_lat.max_ns / 1000.0,
+			latency_avg_us(&read_lat), read_lat.max_ns / 1000.0,
+			header->pass_ns / 1000.0, len);
+		fflush(stdout);
+	}
+
+	/* section: stop the busy children so that their CPU time no longer changes */
+	for (i = 0; i < nr_children; i++) {
+		if (busy[i]) kill(children[i], SIGSTOP);
+	}
+	/* note: the first pass may have sampled a child before it stopped */
+	if (next_snapshot(snapshot_fd) == NULL || (header = next_snapshot(snapshot_fd)) == NULL) {
+		perror("snapshot");
+		kill_children();
+		return 1;
+	}
+
+	/* section: reap each busy child and compare its rusage with cpu_use */
+	{
+		double sum_abs = 0.0, max_abs = 0.0, sum_rel = 0.0, truth, reported, drift;
+		int compared = 0, missing = 0;
+		struct rusage usage;
+		int child_status;
+
+		for (i = 0; i < nr_children; i++) {
+			if (!busy[i]) continue;
+			record = find_record(header, children[i]);
+			kill(children[i], SIGKILL);
+			ret = wait4(children[i], &child_status, 0, &usage);
+			if (ret < 0 || record == NULL) {
+				missing++;
+				continue;
+			}
+			truth = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+				+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+			/* note: cpu_use is sum_exec_runtime in ns with accounting=1, and cputime in jiffies otherwise */
+			if (accounting) {
+				reported = record->cpu_use / 1000000.0;
+			}
+			else {
+				reported = record->cpu_use * 1000.0 / kernel_hz;
+			}
+			drift = reported - truth;
+			if (drift < 0) drift = -drift;
+			sum_abs += drift;
+			if (drift > max_abs) max_abs = drift;
+			if (truth > 0) sum_rel += drift / truth;
+			compared++;
+		}
+		kill_children();
+
+		printf("\ncpu_use drift over %d busy processes (%s, %d missing from the snapshot):\n",
+			compared, accounting ? "accounting=1, ns" : "jiffies", missing);
+		if (compared > 0) {
+			printf("  mean %.3f ms, max %.3f ms, mean relative %.3f %%\n",
+				sum_abs / compared, max_abs, sum_rel / compared * 100.0);
+		}
+	}
+
+	close(status_fd);
+	close(snapshot_fd);
+	return 0;
+}
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "userapp.h"
+#include "mp1_snapshot.h"
+
+/*
+ * exporter - serve the mp1 statistics in OpenMetrics text format
+ *
+ * waits with poll() for each sampling pass on /proc/mp1/snapshot, reads the
+ * binary table once and formats it once. every scraper connecting to the Unix
+ * socket gets the cached text, so scrapers never touch /proc/mp1/status and
+ * the cost per scrape does not depend on how often the module is sampled.
+ *
+ * a client sends an HTTP request (e.g. curl --unix-socket PATH http://localhost/metrics)
+ * or just shuts down its write side, and gets the metrics of the last pass.
+ */
+
+#define SNAPSHOT_FILE "/proc/mp1/snapshot"
+#define DEFAULT_SOCKET "/run/mp1-exporter.sock"
+#define CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#define MAX_CLIENTS 64
+/* note: a client that has not been answered by then is dropped */
+#define CLIENT_TIMEOUT_MS 5000
+/* note: wait this long before reading the snapshot again after a failed read */
+#define RETRY_MS 1000
+
+/** note: formatted metrics. the served copy is never modified: a refresh formats
+ * into another one and swaps them on success, and clients still sending the old
+ * copy hold a reference to it. **/
+struct text {
+	char * buf;
+	size_t len;
+	size_t size;
+	unsigned int refs;
+};
+
+/* note: one scraper, read and answered without blocking from the poll() loop */
+struct client {
+	int fd;
+	char request[1024];
+	size_t len;
+	/* note: set once the request is complete, the text being sent */
+	struct text * text;
+	char head[256];
+	size_t head_len;
+	size_t sent;
+	uint64_t deadline_ms;
+};
+
+static char * snapshot_buf = NULL;
+static size_t snapshot_size = 0;
+static struct text * metrics = NULL;
+/* note: an unreferenced text kept for the next refresh, so it does not reallocate */
+static struct text * spare = NULL;
+static struct client clients[MAX_CLIENTS];
+static int nr_clients = 0;
+static const char * socket_path = DEFAULT_SOCKET;
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int text_printf(struct text * t, const char * fmt, ...)
+{
+	va_list ap;
+	int n;
+	char * buf;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) return -1;
+		if (t->len + n < t->size) {
+			t->len += n;
+			return 0;
+		}
+		/* note: grow and format again */
+		buf = realloc(t->buf, t->size ? t->size * 2 + n : 65536);
+		if (buf == NULL) return -1;
+		t->size = t->size ? t->size * 2 + n : 65536;
+		t->buf = buf;
+	}
+}
+
+static void text_put(struct text * t)
+{
+	if (--t->refs) return;
+	if (spare == NULL) {
+		spare = t;
+		return;
+	}
+	free(t->buf);
+	free(t);
+}
+
+/* section: format the snapshot in snapshot_buf into t */
+static int format_metrics(struct text * t)
+{
+	struct mp1_snapshot_header * header = (struct mp1_snapshot_header *)snapshot_buf;
+	struct mp1_record * record;
+	__u32 i;
+	int err = 0;
+
+	t->len = 0;
+	err |= text_printf(t,
+		"# TYPE mp1_sampling_passes counter\n"
+		"# HELP mp1_sampling_passes Completed sampling passes of the default class.\n"
+		"mp1_sampling_passes_total %llu\n"
+		"# TYPE mp1_sampling_pass_seconds gauge\n"
+		"# UNIT mp1_sampling_pass_seconds seconds\n"
+		"# HELP mp1_sampling_pass_seconds Wall time of the last sampling pass.\n"
+		"mp1_sampling_pass_seconds %.9f\n"
+		"# TYPE mp1_processes gauge\n"
+		"# HELP mp1_processes Registered processes.\n"
+		"mp1_processes %u\n"
+		"# TYPE mp1_snapshot_dropped_processes gauge\n"
+		"# HELP mp1_snapshot_dropped_processes Registered processes left out of the snapshot for lack of room.\n"
+		"mp1_snapshot_dropped_processes %u\n",
+		(unsigned long long)header->generation, header->pass_ns / 1e9, header->nr_records + header->nr_dropped,
+		header->nr_dropped);
+
+	err |= text_printf(t,
+		"# TYPE mp1_process_cpu_use counter\n"
+		"# HELP mp1_process_cpu_use CPU time of the process as reported by mp1 (jiffies, or ns with accounting=1).\n");
+	for (i = 0; i < header->nr_records; i++) {
+		record = (struct mp1_record *)(snapshot_buf + header->header_size + i * header->record_size);
+		err |= text_printf(t, "mp1_process_cpu_use_total{pid=\"%d\"} %llu\n",
+			record->pid, (unsigned long long)record->cpu_use);
+	}
+
+	err |= text_printf(t,
+		"# TYPE mp1_process_utilization gauge\n"
+		"# HELP mp1_process_utilization CPU utilization of the last sampling interval, 1 is one busy CPU.\n");
+	for (i = 0; i < header->nr_records; i++) {
+		record = (struct mp1_record *)(snapshot_buf + header->header_size + i * header->record_size);
+		err |= text_printf(t, "mp1_process_utilization{pid=\"%d\"} %u.%03u\n",
+			record->pid, record->util / 1000, record->util % 1000);
+	}
+
+	err |= text_printf(t,
+		"# TYPE mp1_process_utilization_ewma gauge\n"
+		"# HELP mp1_process_utilization_ewma Moving average of mp1_process_utilization.\n");
+	for (i = 0; i < header->nr_records; i++) {
+		record = (struct mp1_record *)(snapshot_buf + header->header_size + i * header->record_size);
+		err |= text_printf(t, "mp1_process_utilization_ewma{pid=\"%d\"} %u.%03u\n",
+			record->pid, record->util_ewma / 1000, record->util_ewma % 1000);
+	}
+
+	err |= text_printf(t, "# EOF\n");
+	return err ? -1 : 0;
+}
+
+/** note: read and format the snapshot of the last pass. snapshot_buf is only
+ * scratch space, the served copy is replaced only once the new one is complete,
+ * so on failure the last good copy keeps being served. **/
+static int refresh(int snapshot_fd)
+{
+	struct text * t = spare;
+
+	if (t == NULL) t = calloc(1, sizeof(struct text));
+	if (t == NULL) return -1;
+	spare = NULL;
+	t->refs = 1;
+	/* note: reading the snapshot also re-arms poll() */
+	if (pread(snapshot_fd, snapshot_buf, snapshot_size, 0) < (ssize_t)sizeof(struct mp1_snapshot_header) ||
+		format_metrics(t)) {
+		text_put(t);
+		return -1;
+	}
+	if (metrics != NULL) text_put(metrics);
+	metrics = t;
+	return 0;
+}
+
+/* section: scrapers */
+
+static void client_close(int i)
+{
+	close(clients[i].fd);
+	if (clients[i].text != NULL) text_put(clients[i].text);
+	clients[i] = clients[--nr_clients];
+}
+
+static void client_accept(int listen_fd)
+{
+	struct client * c;
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+	if (fd < 0) return;
+	c = &clients[nr_clients++];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->deadline_ms = now_ms() + CLIENT_TIMEOUT_MS;
+}
+
+/* note: the request is complete, answer it with the metrics of the last pass */
+static void client_answer(struct client * c)
+{
+	int n = 0;
+
+	c->text = metrics;
+	c->text->refs++;
+	if (strncmp(c->request, "GET ", 4) == 0) {
+		n = snprintf(c->head, sizeof(c->head),
+			"HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+			CONTENT_TYPE, c->text->len);
+	}
+	c->head_len = n;
+}
+
+/** note: read until the end of the request headers, or until the client shuts
+ * down its write side, then write the head and the text. returns nonzero once
+ * the client is done or has failed. **/
+static int client_io(struct client * c)
+{
+	ssize_t n;
+
+	while (c->text == NULL) {
+		n = read(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len);
+		if (n < 0) return errno != EAGAIN && errno != EINTR;
+		c->len += n;
+		c->request[c->len] = '\0';
+		if (n == 0 || c->len == sizeof(c->request) - 1 ||
+			strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n")) {
+			client_answer(c);
+		}
+	}
+	while (c->sent < c->head_len + c->text->len) {
+		if (c->sent < c->head_len) n = write(c->fd, c->head + c->sent, c->head_len - c->sent);
+		else n = write(c->fd, c->text->buf + c->sent - c->head_len, c->text->len - (c->sent - c->head_len));
+		if (n < 0) return errno != EAGAIN && errno != EINTR;
+		c->sent += n;
+	}
+	return 1;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-s socket_path] [-f]\n", name);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	struct sockaddr_un addr;
+	struct mp1_snapshot_header header;
+	struct pollfd fds[2 + MAX_CLIENTS];
+	struct sigaction sa;
+	uint64_t now, retry_ms = 0;
+	int snapshot_fd, listen_fd, opt, foreground = 0, timeout, n, i;
+
+	while ((opt = getopt(argc, argv, "s:f")) != -1) {
+		switch (opt) {
+		case 's': socket_path = optarg; break;
+		case 'f': foreground = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) usage(argv[0]);
+
+	snapshot_fd = open(SNAPSHOT_FILE, O_RDONLY);
+	if (snapshot_fd < 0) {
+		perror("open " SNAPSHOT_FILE);
+		return 1;
+	}
+	/* note: a read of just the header tells how large the table can get */
+	if (pread(snapshot_fd, &header, sizeof(header), 0) < (ssize_t)sizeof(header)) {
+		perror("snapshot");
+		return 1;
+	}
+	snapshot_size = MP1_SNAPSHOT_BYTES(header.max_records);
+	snapshot_buf = malloc(snapshot_size);
+	if (snapshot_buf == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	if (refresh(snapshot_fd)) {
+		perror("snapshot");
+		return 1;
+	}
+
+	/* section: create the socket */
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 64)) {
+		perror("bind");
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!foreground && daemon(0, 0)) {
+		perror("daemon");
+		return 1;
+	}
+
+	/* section: refresh once per sampling pass, answer scrapers in between */
+	fds[0].fd = snapshot_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = listen_fd;
+	fds[1].events = POLLIN;
+	while (!stop) {
+		/* section: wait for the snapshot, new scrapers, client I/O, or the next timeout */
+		now = now_ms();
+		timeout = -1;
+		if (retry_ms) timeout = retry_ms > now ? (int)(retry_ms - now) : 0;
+		/* note: stop accepting while every client slot is taken, the backlog holds the rest */
+		fds[1].fd = nr_clients < MAX_CLIENTS ? listen_fd : -1;
+		for (i = 0; i < nr_clients; i++) {
+			fds[2 + i].fd = clients[i].fd;
+			fds[2 + i].events = clients[i].text == NULL ? POLLIN : POLLOUT;
+			fds[2 + i].revents = 0;
+			if (timeout < 0 || clients[i].deadline_ms < now + timeout) {
+				timeout = clients[i].deadline_ms > now ? (int)(clients[i].deadline_ms - now) : 0;
+			}
+		}
+		n = nr_clients;
+		if (poll(fds, 2 + n, timeout) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		now = now_ms();
+
+		/* note: after a failed read, leave the snapshot out of poll() for RETRY_MS instead of spinning on it */
+		if (retry_ms && now >= retry_ms) {
+			retry_ms = 0;
+			fds[0].fd = snapshot_fd;
+		}
+		if (fds[0].fd >= 0 && (fds[0].revents & POLLIN)) {
+			/* note: on failure keep serving the last good copy */
+			if (refresh(snapshot_fd)) {
+				fprintf(stderr, "refresh failed\n");
+				retry_ms = now + RETRY_MS;
+				fds[0].fd = -1;
+			}
+		}
+
+		/* note: walk backwards, client_close() moves the last client into the freed slot */
+		for (i = n - 1; i >= 0; i--) {
+			if (fds[2 + i].revents) {
+				if (client_io(&clients[i])) client_close(i);
+			} else if (now >= clients[i].deadline_ms) {
+				client_close(i);
+			}
+		}
+		if (fds[1].fd >= 0 && (fds[1].revents & POLLIN)) client_accept(listen_fd);
+	}
+
+	while (nr_clients > 0) client_close(nr_clients - 1);
+	close(listen_fd);
+	unlink(socket_path);
+	close(snapshot_fd);
+	return 0;
+}
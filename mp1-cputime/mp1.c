@@ -10,10 +10,24 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/workqueue.h>
 #include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/tracepoint.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sort.h>
 
 #include "mp1_given.h"
+#include "mp1_snapshot.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tse-Jui Huang");
@@ -21,34 +35,250 @@ MODULE_DESCRIPTION("CS-423 MP1");
 
 #define DEBUG 1
 
+/* note: 2^MP1_HASH_BITS buckets, each one protected by its own spinlock */
+#define MP1_HASH_BITS 10
+
+/* note: number of samples kept per registered process */
+#define MP1_HISTORY_LEN 8
+/* note: a write() is parsed in chunks of at most MP1_WRITE_CHUNK bytes */
+#define MP1_WRITE_CHUNK (4 * PAGE_SIZE)
+#define MP1_SEPARATORS " \t\n,"
+/* note: initial and maximum number of tasks a single write() can register */
+#define MP1_BATCH_MIN 64
+#define MP1_BATCH_MAX 65536
+
+/* note: the default sampling class plus up to MP1_MAX_CLASSES - 1 configured ones */
+#define MP1_MAX_CLASSES 8
+/* note: upper bound of the shards parameter */
+#define MP1_MAX_SHARDS 64
+
+#define MP1_THROTTLE_NICE 0
+#define MP1_THROTTLE_IDLE 1
+#define MP1_THROTTLE_STOP 2
+
+/* note: the EWMA gives each new sample a weight of 1 / 2^MP1_EWMA_SHIFT */
+#define MP1_EWMA_SHIFT 2
+/* note: fractional bits of the EWMA accumulator */
+#define MP1_EWMA_FRAC 10
+
+/* section: module parameters */
+
+static unsigned int shards = 0;
+module_param(shards, uint, 0444);
+MODULE_PARM_DESC(shards, "number of work items a sampling pass is split into (default 0: one per online CPU)");
+
+static unsigned int interval_ms = 5000;
+module_param(interval_ms, uint, 0444);
+MODULE_PARM_DESC(interval_ms, "sampling interval of the default class in ms (default 5000)");
+
+static unsigned int classes[MP1_MAX_CLASSES - 1];
+static int nr_classes_param = 0;
+module_param_array_named(classes, classes, uint, &nr_classes_param, 0444);
+MODULE_PARM_DESC(classes, "sampling intervals in ms of additional classes, selected with interval=MS at registration");
+
+static int accounting = 0;
+module_param(accounting, int, 0444);
+MODULE_PARM_DESC(accounting, "0: report utime only (default), 1: report utime, stime and sum_exec_runtime in nanoseconds");
+
+static bool thread_group = false;
+module_param(thread_group, bool, 0444);
+MODULE_PARM_DESC(thread_group, "sum the CPU time over all threads of a registered process (implies accounting=1)");
+
+static bool cpu_breakdown = false;
+module_param(cpu_breakdown, bool, 0444);
+MODULE_PARM_DESC(cpu_breakdown, "report runtime per CPU, migrations and involuntary context switches of registered processes");
+
+static unsigned int snapshot_records = 131072;
+module_param(snapshot_records, uint, 0444);
+MODULE_PARM_DESC(snapshot_records, "number of processes the binary snapshot has room for (default 131072)");
+
+static int throttle = MP1_THROTTLE_NICE;
+module_param(throttle, int, 0644);
+MODULE_PARM_DESC(throttle, "action on a process over its CPU budget: 0: nice 19 (default), 1: SCHED_IDLE, 2: SIGSTOP until the next window");
+
 /* section: type definition */
 
+struct mp1_sample {
+   u64 timestamp_ns;
+   u64 cpu_ns;
+};
+
+/* note: per-CPU counters of a registered process, only written on their own CPU */
+struct mp1_cpu_stats {
+   u64 runtime_ns;
+   u64 migrations;
+   u64 nivcsw;
+   /* note: sum_exec_runtime of the thread running on this CPU when it was switched in */
+   u64 switch_in_runtime;
+   int switched_in;
+};
+
 struct pid_entry {
+   /* note: global (init namespace) pid or tgid, the key the tracepoints look up */
    long pid;
+   /* note: pinned with get_task_struct(), released after the RCU grace period */
+   struct task_struct * task;
    unsigned long cpu_use;
-   struct list_head ptrs;
+   /* note: values published by the work function when accounting=1 */
+   u64 utime_ns;
+   u64 stime_ns;
+   u64 runtime_ns;
+   /* note: thread group totals, folded in by mp1_probe_stat_runtime() */
+   atomic64_t group_utime;
+   atomic64_t group_stime;
+   atomic64_t group_runtime;
+   /* note: ring of the last samples, history[(nr_samples - 1) % MP1_HISTORY_LEN] is the newest */
+   struct mp1_sample history[MP1_HISTORY_LEN];
+   u32 nr_samples;
+   /* note: utilization of the last interval and its EWMA, in per-mille of one CPU */
+   u32 util;
+   u32 util_ewma;
+   s64 ewma_fp;
+   /* note: CPU budget per window, 0 if the process is only observed */
+   u64 budget_ns;
+   u64 window_ns;
+   /* note: budget enforcement state, only touched by the work function */
+   u64 window_start_ns;
+   u64 window_start_cpu;
+   int throttled;
+   int saved_policy;
+   unsigned int saved_rt_priority;
+   long saved_nice;
+   /* note: allocated only when cpu_breakdown=1 */
+   struct mp1_cpu_stats __percpu * cpu_stats;
+   /* note: index into mp1_classes, and the node in the entry list of its shard of that class */
+   unsigned int class;
+   /* note: held while the work function samples the entry, see mp1_move_class() */
+   spinlock_t sample_lock;
+   struct hlist_node class_node;
+   struct hlist_node node;
+   struct rcu_head rcu;
+};
+
+/* note: per-process settings given as key=value tokens in a write() */
+struct mp1_options {
+   unsigned int set;
+   u64 budget_ns;
+   u64 window_ns;
+   unsigned int class;
+};
+
+#define MP1_OPTION_BUDGET 0x1
+#define MP1_OPTION_CLASS 0x2
+
+/* note: a batch slot holds a pinned task, then the entry created for it */
+struct mp1_slot {
+   union {
+      struct task_struct * task;
+      struct pid_entry * entry;
+   };
+   struct mp1_options options;
+};
+
+struct mp1_batch {
+   struct mp1_slot * slots;
+   unsigned int nr;
+   unsigned int capacity;
+   /* note: options applied to the tasks collected from now on */
+   struct mp1_options options;
+};
+
+/** note: the entries of a class are split into shards by PID. every shard has
+ * its own work item, so the shards of one pass are sampled in parallel by the
+ * unbound workqueue. entries is modified under lock and walked under RCU. **/
+struct mp1_shard {
+   struct mp1_class * class;
+   struct work_struct work;
+   spinlock_t lock;
+   struct hlist_head entries;
+};
+
+/** note: a sampling class has its own hrtimer and samples only its own entries.
+ * pending is the number of shards of the running pass plus one; the last shard
+ * to finish ends the pass and drops the extra one, so the next pass cannot start
+ * before it is done. class 0 is the default class; its pass also publishes the
+ * snapshot. **/
+struct mp1_class {
+   unsigned int interval_ms;
+   ktime_t period;
+   struct hrtimer timer;
+   atomic_t pending;
+   u64 pass_start_ns;
+   struct mp1_shard shards[MP1_MAX_SHARDS];
+};
+
+struct mp1_tracepoint {
+   const char * name;
+   void * probe;
+   struct tracepoint * tp;
 };
 
 /* section: function declaration */
 
 static int mp1_show(struct seq_file * m, void * v);
 static int mp1_open(struct inode *inode, struct file *file);
+static int mp1_history_show(struct seq_file * m, void * v);
+static int mp1_history_open(struct inode *inode, struct file *file);
+static int mp1_snapshot_open(struct inode *inode, struct file *file);
+static int mp1_snapshot_release(struct inode *inode, struct file *file);
+static ssize_t mp1_snapshot_read(struct file * file, char __user * ubuf, size_t size, loff_t * pos);
+static int mp1_snapshot_mmap(struct file * file, struct vm_area_struct * vma);
+static unsigned int mp1_snapshot_poll(struct file * file, struct poll_table_struct * wait);
 ssize_t mp1_write(struct file * file, const char __user * ubuf, size_t size, loff_t * pos);
 void mp1_work_function(struct work_struct * work);
-void timer_callback(unsigned long data);
+static enum hrtimer_restart mp1_class_timer(struct hrtimer * timer);
+static void mp1_probe_stat_runtime(void * data, struct task_struct * tsk, u64 runtime, u64 vruntime);
+static void mp1_probe_process_exit(void * data, struct task_struct * p);
+static void mp1_probe_sched_switch(void * data, bool preempt, struct task_struct * prev, struct task_struct * next);
+static void mp1_probe_migrate_task(void * data, struct task_struct * p, int dest_cpu);
 
 /* section: variable initialization */
 
 static struct proc_dir_entry* mp1_proc;
+static struct proc_dir_entry* mp1_snapshot_proc;
+static struct proc_dir_entry* mp1_history_proc;
 static struct proc_dir_entry* mp1_dir;
-static char * input_str;
 
-static struct list_head mp1_entries;
-static struct timer_list mp1_timer;
+static struct kmem_cache * mp1_entries_slab = NULL;
+
+/* note: vmalloc'ed table of struct mp1_record, published by the work function */
+static char * mp1_snapshot = NULL;
+/* note: MP1_SNAPSHOT_BYTES(snapshot_records), rounded up to whole pages for mmap() */
+static unsigned long mp1_snapshot_size = 0;
+/* note: woken once after every published snapshot */
+static DECLARE_WAIT_QUEUE_HEAD(mp1_snapshot_waitqueue);
+
+/** note: registered processes are kept in a PID-keyed hash table.
+ * readers (mp1_show, mp1_work_function) traverse it under rcu_read_lock(),
+ * writers only take the spinlock of the bucket they modify. **/
+static DEFINE_HASHTABLE(mp1_entries, MP1_HASH_BITS);
+static spinlock_t mp1_bucket_locks[1 << MP1_HASH_BITS];
+static atomic_t mp1_nr_entries = ATOMIC_INIT(0);
+
+static struct mp1_class mp1_classes[MP1_MAX_CLASSES];
+static unsigned int mp1_nr_classes;
+static unsigned int mp1_nr_shards;
 static struct workqueue_struct * mp1_workqueue;
-struct work_struct * deferred_work;
 
-DEFINE_MUTEX(linked_list_mutex);
+static struct mp1_tracepoint mp1_stat_runtime_tp = {
+   .name = "sched_stat_runtime",
+   .probe = mp1_probe_stat_runtime,
+};
+
+static struct mp1_tracepoint mp1_process_exit_tp = {
+   .name = "sched_process_exit",
+   .probe = mp1_probe_process_exit,
+};
+
+static struct mp1_tracepoint mp1_sched_switch_tp = {
+   .name = "sched_switch",
+   .probe = mp1_probe_sched_switch,
+};
+
+static struct mp1_tracepoint mp1_migrate_task_tp = {
+   .name = "sched_migrate_task",
+   .probe = mp1_probe_migrate_task,
+};
 
 static const struct file_operations mp1_fops = {
    .owner = THIS_MODULE,
@@ -59,21 +289,547 @@ static const struct file_operations mp1_fops = {
    .write = mp1_write
 };
 
+static const struct file_operations mp1_history_fops = {
+   .owner = THIS_MODULE,
+   .open = mp1_history_open,
+   .read = seq_read,
+   .llseek = seq_lseek,
+   .release = single_release
+};
+
+static const struct file_operations mp1_snapshot_fops = {
+   .owner = THIS_MODULE,
+   .open = mp1_snapshot_open,
+   .release = mp1_snapshot_release,
+   .read = mp1_snapshot_read,
+   .mmap = mp1_snapshot_mmap,
+   .poll = mp1_snapshot_poll
+};
+
 /* section: function definition */
 
+static inline spinlock_t * mp1_bucket_lock(long pid)
+{
+   return &mp1_bucket_locks[hash_min(pid, MP1_HASH_BITS)];
+}
+
+/* note: caller must hold rcu_read_lock() or the bucket lock of pid */
+static struct pid_entry * mp1_lookup(long pid)
+{
+   struct pid_entry *tmp;
+
+   hash_for_each_possible_rcu(mp1_entries, tmp, node, pid)
+   {
+      if (tmp->pid == pid) return tmp;
+   }
+   return NULL;
+}
+
+static void mp1_free_entry(struct rcu_head * rcu)
+{
+   struct pid_entry * entry = container_of(rcu, struct pid_entry, rcu);
+
+   put_task_struct(entry->task);
+   free_percpu(entry->cpu_stats);
+   kmem_cache_free(mp1_entries_slab, entry);
+}
+
+static inline struct mp1_shard * mp1_shard_of(struct pid_entry * entry)
+{
+   return &mp1_classes[entry->class].shards[(u32)entry->pid % mp1_nr_shards];
+}
+
+/* note: caller must hold the bucket lock of entry and entry must still be hashed */
+static void mp1_unlink(struct pid_entry * entry)
+{
+   struct mp1_shard * shard = mp1_shard_of(entry);
+
+   hash_del_rcu(&entry->node);
+   spin_lock(&shard->lock);
+   hlist_del_init_rcu(&entry->class_node);
+   spin_unlock(&shard->lock);
+}
+
+/* note: unlink entry and free it after all current RCU readers are done */
+static void mp1_remove(struct pid_entry * entry)
+{
+   spinlock_t * lock = mp1_bucket_lock(entry->pid);
+
+   spin_lock(lock);
+   if (hlist_unhashed(&entry->node))
+   {
+      /* note: somebody else already removed it */
+      spin_unlock(lock);
+      return;
+   }
+   mp1_unlink(entry);
+   spin_unlock(lock);
+   atomic_dec(&mp1_nr_entries);
+   call_rcu(&entry->rcu, mp1_free_entry);
+}
+
+/* note: caller must hold the bucket lock of entry, which keeps it hashed */
+static void mp1_add_class(struct pid_entry * entry)
+{
+   struct mp1_shard * shard = mp1_shard_of(entry);
+
+   spin_lock(&shard->lock);
+   hlist_add_head_rcu(&entry->class_node, &shard->entries);
+   spin_unlock(&shard->lock);
+}
+
+/** note: move entry to another class. caller must hold the bucket lock of entry.
+ * the entry is re-added without waiting for a grace period, so a walker of the
+ * old shard may still be sampling it when the walker of the new shard reaches
+ * it. sample_lock keeps them from writing its state at the same time. a walker
+ * standing on entry follows it into the new list and skips the rest of its own
+ * shard for that pass. **/
+static void mp1_move_class(struct pid_entry * entry, unsigned int class)
+{
+   struct mp1_shard * shard = mp1_shard_of(entry);
+
+   if (entry->class == class) return;
+   spin_lock(&shard->lock);
+   hlist_del_rcu(&entry->class_node);
+   spin_unlock(&shard->lock);
+   entry->class = class;
+   mp1_add_class(entry);
+}
+
+/* note: true once the process behind entry has started to exit */
+static bool mp1_entry_dead(struct pid_entry * entry)
+{
+   if (thread_group) return atomic_read(&entry->task->signal->live) == 0;
+   return (entry->task->flags & PF_EXITING) != 0;
+}
+
+/* note: pid of entry as seen from the namespace of current, 0 when it is not visible there */
+static pid_t mp1_entry_vnr(struct pid_entry * entry)
+{
+   if (thread_group) return task_tgid_vnr(entry->task);
+   return task_pid_vnr(entry->task);
+}
+
+/** note: split rtime in the ratio part / total, like cputime_adjust() does.
+ * precision is dropped from part and total until rtime * part fits in 64 bits **/
+static u64 mp1_scale(u64 rtime, u64 part, u64 total)
+{
+   if (part >= total) return rtime;
+   while (fls64(rtime) + fls64(part) > 64)
+   {
+      part >>= 1;
+      total >>= 1;
+   }
+   if (!total) return 0;
+   return div64_u64(rtime * part, total);
+}
+
+static void mp1_match_tracepoint(struct tracepoint * tp, void * priv)
+{
+   struct mp1_tracepoint * target = priv;
+
+   if (!strcmp(tp->name, target->name)) target->tp = tp;
+}
+
+static int mp1_attach_tracepoint(struct mp1_tracepoint * target)
+{
+   /* note: scheduler tracepoints are not exported, look them up by name */
+   for_each_kernel_tracepoint(mp1_match_tracepoint, target);
+   if (target->tp == NULL)
+   {
+      printk(KERN_ALERT "tracepoint %s not found.\n", target->name);
+      return -ENOENT;
+   }
+   return tracepoint_probe_register(target->tp, target->probe, NULL);
+}
+
+static void mp1_detach_tracepoint(struct mp1_tracepoint * target)
+{
+   if (target->tp == NULL) return;
+   tracepoint_probe_unregister(target->tp, target->probe, NULL);
+   target->tp = NULL;
+}
+
+/* note: detach every attached probe and wait until none of them is running */
+static void mp1_detach_all_tracepoints(void)
+{
+   mp1_detach_tracepoint(&mp1_process_exit_tp);
+   mp1_detach_tracepoint(&mp1_stat_runtime_tp);
+   mp1_detach_tracepoint(&mp1_sched_switch_tp);
+   mp1_detach_tracepoint(&mp1_migrate_task_tp);
+   tracepoint_synchronize_unregister();
+}
+
+/* note: entry of the thread (or its thread group) if it has per-CPU counters. caller must hold rcu_read_lock() */
+static struct pid_entry * mp1_lookup_cpu_stats(struct task_struct * p)
+{
+   struct pid_entry * entry;
+
+   if (thread_group)
+   {
+      entry = mp1_lookup(p->tgid);
+   }
+   else
+   {
+      entry = mp1_lookup(p->pid);
+      if (entry != NULL && entry->task != p) entry = NULL;
+   }
+   if (entry != NULL && entry->cpu_stats == NULL) entry = NULL;
+   return entry;
+}
+
+/** note: called by __schedule() on every context switch with the runqueue lock
+ * held and interrupts disabled. the runtime of a registered thread is charged
+ * to the CPU it ran on when it is switched out. a switch-out is involuntary
+ * when the thread was preempted or is still runnable. **/
+static void mp1_probe_sched_switch(void * data, bool preempt, struct task_struct * prev, struct task_struct * next)
+{
+   struct pid_entry *entry;
+   struct mp1_cpu_stats *stats;
+
+   if (!atomic_read(&mp1_nr_entries)) return;
+
+   rcu_read_lock();
+   entry = mp1_lookup_cpu_stats(prev);
+   if (entry != NULL)
+   {
+      stats = this_cpu_ptr(entry->cpu_stats);
+      if (stats->switched_in)
+      {
+         stats->runtime_ns += prev->se.sum_exec_runtime - stats->switch_in_runtime;
+         stats->switched_in = 0;
+      }
+      if (preempt || prev->state == TASK_RUNNING) stats->nivcsw++;
+   }
+   entry = mp1_lookup_cpu_stats(next);
+   if (entry != NULL)
+   {
+      stats = this_cpu_ptr(entry->cpu_stats);
+      stats->switch_in_runtime = next->se.sum_exec_runtime;
+      stats->switched_in = 1;
+   }
+   rcu_read_unlock();
+}
+
+/* note: called with interrupts disabled, the migration is counted on the CPU doing it */
+static void mp1_probe_migrate_task(void * data, struct task_struct * p, int dest_cpu)
+{
+   struct pid_entry *entry;
+
+   if (!atomic_read(&mp1_nr_entries)) return;
+   if (task_cpu(p) == dest_cpu) return;
+
+   rcu_read_lock();
+   entry = mp1_lookup_cpu_stats(p);
+   if (entry != NULL)
+   {
+      this_cpu_ptr(entry->cpu_stats)->migrations++;
+   }
+   rcu_read_unlock();
+}
+
+/** note: called by do_exit() for every exiting thread, after PF_EXITING is set
+ * and signal->live is decremented. the entry is retired right away instead of
+ * being found dead by the next sampling pass. **/
+static void mp1_probe_process_exit(void * data, struct task_struct * p)
+{
+   struct pid_entry *entry;
+
+   if (!atomic_read(&mp1_nr_entries)) return;
+
+   rcu_read_lock();
+   if (thread_group)
+   {
+      /* note: a thread group is retired by its last exiting thread */
+      entry = atomic_read(&p->signal->live) == 0 ? mp1_lookup(p->tgid) : NULL;
+   }
+   else
+   {
+      entry = mp1_lookup(p->pid);
+   }
+   if (entry != NULL && (thread_group || entry->task == p))
+   {
+      mp1_remove(entry);
+   }
+   rcu_read_unlock();
+}
+
+/** note: called by update_curr() with the runqueue lock held, for every CFS
+ * thread in the system. the runtime delta of the thread is folded into the
+ * entry of its thread group, so no thread list is ever walked while sampling.
+ * the delta is split into user and system time with the thread's own
+ * utime : stime ratio. **/
+static void mp1_probe_stat_runtime(void * data, struct task_struct * tsk, u64 runtime, u64 vruntime)
+{
+   struct pid_entry *entry;
+   u64 utime;
+
+   if (!atomic_read(&mp1_nr_entries)) return;
+
+   rcu_read_lock();
+   entry = mp1_lookup(tsk->tgid);
+   if (entry != NULL)
+   {
+      utime = mp1_scale(runtime, (u64)tsk->utime, (u64)tsk->utime + (u64)tsk->stime);
+      atomic64_add(runtime, &entry->group_runtime);
+      atomic64_add(utime, &entry->group_utime);
+      atomic64_add(runtime - utime, &entry->group_stime);
+   }
+   rcu_read_unlock();
+}
+
+/** note: seed the thread group totals of a new entry. this is the only place
+ * where the thread list is walked; later deltas come from the tracepoint.
+ * caller must hold rcu_read_lock(). **/
+static void mp1_group_init(struct pid_entry * entry, struct task_struct * task)
+{
+   struct task_struct *t;
+   u64 utime, stime, runtime;
+
+   /* note: signal_struct holds the time of threads which already exited */
+   utime = cputime_to_nsecs(task->signal->utime);
+   stime = cputime_to_nsecs(task->signal->stime);
+   runtime = task->signal->sum_sched_runtime;
+   for_each_thread(task, t)
+   {
+      utime += cputime_to_nsecs(t->utime);
+      stime += cputime_to_nsecs(t->stime);
+      runtime += t->se.sum_exec_runtime;
+   }
+   utime = mp1_scale(runtime, utime, utime + stime);
+   atomic64_set(&entry->group_utime, utime);
+   atomic64_set(&entry->group_stime, runtime - utime);
+   atomic64_set(&entry->group_runtime, runtime);
+}
+
+/* note: updates the published values from the pinned task, no PID lookup */
+static void mp1_sample_ns(struct pid_entry * entry)
+{
+   u64 utime, stime, runtime;
+
+   if (thread_group)
+   {
+      runtime = atomic64_read(&entry->group_runtime);
+      utime = atomic64_read(&entry->group_utime);
+      stime = atomic64_read(&entry->group_stime);
+   }
+   else
+   {
+      get_task_cpu_use_ns(entry->task, &utime, &stime, &runtime);
+      /* note: utime and stime are tick sampled, scale them to the precise runtime */
+      utime = mp1_scale(runtime, utime, utime + stime);
+      stime = runtime - utime;
+   }
+   WRITE_ONCE(entry->utime_ns, utime);
+   WRITE_ONCE(entry->stime_ns, stime);
+   WRITE_ONCE(entry->runtime_ns, runtime);
+   WRITE_ONCE(entry->cpu_use, (unsigned long)runtime);
+}
+
+/* note: apply nice to the task of entry, or to all of its threads when thread_group=1 */
+static void mp1_set_nice(struct pid_entry * entry, long nice)
+{
+   struct task_struct *t;
+
+   if (!thread_group)
+   {
+      set_user_nice(entry->task, nice);
+      return;
+   }
+   for_each_thread(entry->task, t)
+   {
+      set_user_nice(t, nice);
+   }
+}
+
+/* note: apply policy to the task of entry, or to all of its threads when thread_group=1 */
+static void mp1_set_policy(struct pid_entry * entry, int policy, struct sched_param * param)
+{
+   struct task_struct *t;
+
+   if (!thread_group)
+   {
+      sched_setscheduler(entry->task, policy, param);
+      return;
+   }
+   for_each_thread(entry->task, t)
+   {
+      sched_setscheduler(t, policy, param);
+   }
+}
+
+/** note: apply the throttle action to the process of entry and remember how
+ * to undo it. throttled holds the action + 1, so that 0 means not throttled.
+ * caller must hold rcu_read_lock(), which also covers the thread walk;
+ * set_user_nice() and sched_setscheduler() do not sleep. **/
+static void mp1_throttle(struct pid_entry * entry)
+{
+   struct sched_param param = { .sched_priority = 0 };
+   int action = READ_ONCE(throttle);
+
+   switch (action)
+   {
+   case MP1_THROTTLE_STOP:
+      /* note: SIGSTOP stops the whole thread group */
+      send_sig(SIGSTOP, entry->task, 1);
+      break;
+   case MP1_THROTTLE_IDLE:
+      entry->saved_policy = entry->task->policy;
+      entry->saved_rt_priority = entry->task->rt_priority;
+      mp1_set_policy(entry, SCHED_IDLE, &param);
+      break;
+   default:
+      action = MP1_THROTTLE_NICE;
+      entry->saved_nice = task_nice(entry->task);
+      mp1_set_nice(entry, MAX_NICE);
+      break;
+   }
+   WRITE_ONCE(entry->throttled, action + 1);
+}
+
+static void mp1_unthrottle(struct pid_entry * entry)
+{
+   struct sched_param param = { .sched_priority = entry->saved_rt_priority };
+
+   switch (entry->throttled - 1)
+   {
+   case MP1_THROTTLE_STOP:
+      send_sig(SIGCONT, entry->task, 1);
+      break;
+   case MP1_THROTTLE_IDLE:
+      mp1_set_policy(entry, entry->saved_policy, &param);
+      break;
+   default:
+      mp1_set_nice(entry, entry->saved_nice);
+      break;
+   }
+   WRITE_ONCE(entry->throttled, 0);
+}
+
+/** note: budget windows start at a sampling pass and are checked once per
+ * pass, so a process can overrun its budget by up to one sampling interval.
+ * caller must hold rcu_read_lock(). **/
+static void mp1_enforce_budget(struct pid_entry * entry, u64 now, u64 cpu_ns)
+{
+   u64 budget = READ_ONCE(entry->budget_ns);
+   u64 window = READ_ONCE(entry->window_ns);
+
+   if (budget == 0)
+   {
+      if (entry->throttled) mp1_unthrottle(entry);
+      entry->window_start_ns = 0;
+      return;
+   }
+
+   /* section: start a new window, restoring the process if it was throttled */
+   if (entry->window_start_ns == 0 || now - entry->window_start_ns >= window)
+   {
+      if (entry->throttled) mp1_unthrottle(entry);
+      entry->window_start_ns = now;
+      entry->window_start_cpu = cpu_ns;
+      return;
+   }
+
+   /* section: throttle the process once it has used up its budget */
+   if (!entry->throttled && cpu_ns - entry->window_start_cpu > budget)
+   {
+      mp1_throttle(entry);
+   }
+}
+
+/** note: push a sample into the history ring of entry and update the rate of
+ * the last interval and its EWMA. only the work function writes the ring, so
+ * readers may see the newest sample half written, but never freed memory. **/
+static void mp1_record_sample(struct pid_entry * entry, u64 now, u64 cpu_ns)
+{
+   struct mp1_sample * last;
+   struct mp1_sample * sample;
+   u32 util;
+
+   if (entry->nr_samples > 0)
+   {
+      last = &entry->history[(entry->nr_samples - 1) % MP1_HISTORY_LEN];
+      if (now > last->timestamp_ns && cpu_ns >= last->cpu_ns)
+      {
+         util = (u32)div64_u64((cpu_ns - last->cpu_ns) * 1000, now - last->timestamp_ns);
+         if (entry->nr_samples == 1)
+         {
+            /* note: seed the EWMA with the first measured interval */
+            entry->ewma_fp = (s64)util << MP1_EWMA_FRAC;
+         }
+         else
+         {
+            entry->ewma_fp += (((s64)util << MP1_EWMA_FRAC) - entry->ewma_fp) >> MP1_EWMA_SHIFT;
+         }
+         WRITE_ONCE(entry->util, util);
+         WRITE_ONCE(entry->util_ewma, (u32)(entry->ewma_fp >> MP1_EWMA_FRAC));
+      }
+   }
+
+   sample = &entry->history[entry->nr_samples % MP1_HISTORY_LEN];
+   WRITE_ONCE(sample->timestamp_ns, now);
+   WRITE_ONCE(sample->cpu_ns, cpu_ns);
+   smp_wmb();
+   WRITE_ONCE(entry->nr_samples, entry->nr_samples + 1);
+}
+
+/* note: print migrations, involuntary switches and the runtime on each CPU the process ran on */
+static void mp1_show_cpu_stats(struct seq_file * m, struct pid_entry * entry)
+{
+   struct mp1_cpu_stats *stats;
+   u64 migrations = 0, nivcsw = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+   {
+      stats = per_cpu_ptr(entry->cpu_stats, cpu);
+      migrations += READ_ONCE(stats->migrations);
+      nivcsw += READ_ONCE(stats->nivcsw);
+   }
+   seq_printf(m, " migrations=%llu nivcsw=%llu", migrations, nivcsw);
+   for_each_possible_cpu(cpu)
+   {
+      stats = per_cpu_ptr(entry->cpu_stats, cpu);
+      if (READ_ONCE(stats->runtime_ns)) seq_printf(m, " cpu%d=%llu", cpu, READ_ONCE(stats->runtime_ns));
+   }
+}
+
 static int mp1_show(struct seq_file * m, void * v)
 {
-   struct list_head *pos, *q;
    struct pid_entry *tmp;
+   pid_t vpid;
+   int bkt;
 
-   /* section: iterate each linked list and print out cpu_use */
-   mutex_lock(&linked_list_mutex);
-   list_for_each_safe(pos, q, &mp1_entries)
+   /* section: iterate the hash table and print out cpu_use */
+   /* note: no lock is taken, so readers never stall the work function */
+   rcu_read_lock();
+   hash_for_each_rcu(mp1_entries, bkt, tmp, node)
    {
-      tmp = list_entry(pos, struct pid_entry, ptrs);
-      seq_printf(m, "%ld: %lu\n", tmp->pid, tmp->cpu_use);
+      vpid = mp1_entry_vnr(tmp);
+      if (vpid == 0) continue;
+      seq_printf(m, "%d: %lu", vpid, READ_ONCE(tmp->cpu_use));
+      if (accounting)
+      {
+         seq_printf(m, " utime=%llu stime=%llu runtime=%llu",
+            READ_ONCE(tmp->utime_ns), READ_ONCE(tmp->stime_ns), READ_ONCE(tmp->runtime_ns));
+      }
+      seq_printf(m, " util=%u ewma=%u", READ_ONCE(tmp->util), READ_ONCE(tmp->util_ewma));
+      if (mp1_nr_classes > 1)
+      {
+         seq_printf(m, " interval=%u", mp1_classes[READ_ONCE(tmp->class)].interval_ms);
+      }
+      if (READ_ONCE(tmp->budget_ns))
+      {
+         seq_printf(m, " budget=%llu/%llu throttled=%d", div_u64(READ_ONCE(tmp->budget_ns), NSEC_PER_MSEC),
+            div_u64(READ_ONCE(tmp->window_ns), NSEC_PER_MSEC), READ_ONCE(tmp->throttled) != 0);
+      }
+      if (tmp->cpu_stats != NULL)
+      {
+         mp1_show_cpu_stats(m, tmp);
+      }
+      seq_putc(m, '\n');
    }
-   mutex_unlock(&linked_list_mutex);
+   rcu_read_unlock();
 
    return 0;
 }
@@ -83,122 +839,737 @@ static int mp1_open(struct inode *inode, struct file *file)
    return single_open(file, mp1_show, NULL);
 }
 
-ssize_t mp1_write(struct file * file, const char __user * ubuf, size_t size, loff_t * pos)
+static int mp1_history_show(struct seq_file * m, void * v)
 {
-   long pid = 0;
-   struct pid_entry * new_entry = NULL;
+   struct pid_entry *tmp;
+   struct mp1_sample *sample;
+   u32 nr_samples, i;
+   pid_t vpid;
+   int bkt;
 
-   if (input_str != NULL) {
-      printk(KERN_ALERT "input_str is not null.\n");
-      kfree(input_str);
-      input_str = NULL;
-   } else {
-      printk(KERN_ALERT "input_str is null.\n");
+   /* section: print the samples of each process, oldest first, as timestamp_ns:cpu_ns */
+   rcu_read_lock();
+   hash_for_each_rcu(mp1_entries, bkt, tmp, node)
+   {
+      nr_samples = READ_ONCE(tmp->nr_samples);
+      smp_rmb();
+      vpid = mp1_entry_vnr(tmp);
+      if (vpid == 0) continue;
+      seq_printf(m, "%d:", vpid);
+      i = nr_samples > MP1_HISTORY_LEN ? nr_samples - MP1_HISTORY_LEN : 0;
+      for (; i < nr_samples; i++)
+      {
+         sample = &tmp->history[i % MP1_HISTORY_LEN];
+         seq_printf(m, " %llu:%llu", READ_ONCE(sample->timestamp_ns), READ_ONCE(sample->cpu_ns));
+      }
+      seq_putc(m, '\n');
    }
+   rcu_read_unlock();
+
+   return 0;
+}
+
+static int mp1_history_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, mp1_history_show, NULL);
+}
+
+/** note: rewrite the snapshot table from the hash table. there is only one
+ * writer (the work function), readers never block it: they retry instead. **/
+static void mp1_publish_snapshot(u64 pass_ns)
+{
+   struct mp1_snapshot_header * header = (struct mp1_snapshot_header *)mp1_snapshot;
+   struct mp1_record * records = (struct mp1_record *)(mp1_snapshot + sizeof(struct mp1_snapshot_header));
+   struct pid_entry *tmp;
+   u32 nr_records = 0, nr_dropped = 0;
+   int bkt;
+
+   /* section: make sequence odd, readers will retry until it is even again */
+   WRITE_ONCE(header->sequence, header->sequence + 1);
+   smp_wmb();
 
-   printk(KERN_ALERT "size passed from parameter: %lu\n", size);
-   input_str = kzalloc(size + 1, GFP_KERNEL);
-   if (input_str == NULL)
+   rcu_read_lock();
+   hash_for_each_rcu(mp1_entries, bkt, tmp, node)
    {
-      printk(KERN_ALERT "unable to kzalloc.\n");
-      return -ENOMEM;
+      if (nr_records == snapshot_records)
+      {
+         /* note: the remaining entries are counted, not walked */
+         nr_dropped = max_t(int, atomic_read(&mp1_nr_entries) - (int)nr_records, 1);
+         printk_ratelimited(KERN_ALERT "snapshot is full, %u processes left out.\n", nr_dropped);
+         goto full;
+      }
+      records[nr_records].pid = (s32)tmp->pid;
+      records[nr_records].util = READ_ONCE(tmp->util);
+      records[nr_records].cpu_use = READ_ONCE(tmp->cpu_use);
+      records[nr_records].util_ewma = READ_ONCE(tmp->util_ewma);
+      records[nr_records].reserved = 0;
+      nr_records++;
+   }
+full:
+   rcu_read_unlock();
+
+   header->nr_records = nr_records;
+   header->nr_dropped = nr_dropped;
+   header->generation++;
+   header->timestamp_ns = ktime_get_ns();
+   header->pass_ns = pass_ns;
+
+   smp_wmb();
+   WRITE_ONCE(header->sequence, header->sequence + 1);
+
+   /* section: notify poll()/epoll() waiters of the new sampling pass */
+   wake_up_interruptible(&mp1_snapshot_waitqueue);
+}
+
+static inline u64 mp1_snapshot_generation(void)
+{
+   return READ_ONCE(((struct mp1_snapshot_header *)mp1_snapshot)->generation);
+}
+
+static int mp1_snapshot_open(struct inode *inode, struct file *file)
+{
+   /* note: an open (or mmap()ed) snapshot keeps the table from being freed */
+   if (!try_module_get(THIS_MODULE)) return -ENODEV;
+   /* note: private_data holds the last generation this file has seen */
+   file->private_data = (void *)(unsigned long)mp1_snapshot_generation();
+   return 0;
+}
+
+static int mp1_snapshot_release(struct inode *inode, struct file *file)
+{
+   module_put(THIS_MODULE);
+   return 0;
+}
+
+/** note: each read() from offset 0 returns the header and as many whole records
+ * as fit in the buffer, all from the same sampling pass. use pread(fd, buf, size, 0)
+ * to take another snapshot with the same file descriptor. **/
+static ssize_t mp1_snapshot_read(struct file * file, char __user * ubuf, size_t size, loff_t * pos)
+{
+   struct mp1_snapshot_header * shared = (struct mp1_snapshot_header *)mp1_snapshot;
+   struct mp1_snapshot_header header;
+   size_t nr_records = 0, length = 0;
+   u32 sequence;
+
+   if (*pos != 0) return 0;
+   if (size < sizeof(struct mp1_snapshot_header)) return -EINVAL;
+
+   /* section: copy the records, retry if the work function rewrote them meanwhile */
+   do {
+      sequence = READ_ONCE(shared->sequence);
+      if (sequence & 1)
+      {
+         cond_resched();
+         continue;
+      }
+      smp_rmb();
+      header = *shared;
+      nr_records = min_t(size_t, header.nr_records,
+         (size - sizeof(struct mp1_snapshot_header)) / sizeof(struct mp1_record));
+      length = nr_records * sizeof(struct mp1_record);
+      if (copy_to_user(ubuf + sizeof(struct mp1_snapshot_header),
+            mp1_snapshot + sizeof(struct mp1_snapshot_header), length))
+      {
+         return -EFAULT;
+      }
+      smp_rmb();
+   } while ((sequence & 1) || READ_ONCE(shared->sequence) != sequence);
+
+   /* note: the header tells how many records were actually copied */
+   header.sequence = sequence;
+   header.nr_records = (u32)nr_records;
+   if (copy_to_user(ubuf, &header, sizeof(struct mp1_snapshot_header))) return -EFAULT;
+   file->private_data = (void *)(unsigned long)header.generation;
+
+   length += sizeof(struct mp1_snapshot_header);
+   *pos += length;
+   return (ssize_t)length;
+}
+
+/** note: the file becomes readable once per completed sampling pass: poll()
+ * reports POLLIN until the new snapshot has been read from this file. **/
+static unsigned int mp1_snapshot_poll(struct file * file, struct poll_table_struct * wait)
+{
+   poll_wait(file, &mp1_snapshot_waitqueue, wait);
+   if ((unsigned long)mp1_snapshot_generation() != (unsigned long)file->private_data)
+   {
+      return POLLIN | POLLRDNORM;
+   }
+   return 0;
+}
+
+static int mp1_snapshot_mmap(struct file * file, struct vm_area_struct * vma)
+{
+   unsigned long pfn, i;
+   unsigned long length = vma->vm_end - vma->vm_start;
+
+   /* note: the table is written by the work function only, map it read-only */
+   if (vma->vm_flags & VM_WRITE) return -EPERM;
+   if (vma->vm_pgoff != 0 || length > mp1_snapshot_size) return -EINVAL;
+   vma->vm_flags &= ~VM_MAYWRITE;
+
+   /* section: mapping the vmalloc memory to userspace */
+   /* note: memory allocated by vmalloc can be discontinuous, each page should be mapped respectively */
+   for (i = 0; i < length; i += PAGE_SIZE)
+   {
+      pfn = vmalloc_to_pfn(mp1_snapshot + i);
+      if (remap_pfn_range(vma, vma->vm_start + i, pfn, PAGE_SIZE, vma->vm_page_prot))
+      {
+         printk(KERN_ALERT "error remapping %lu.\n", i);
+         return -EAGAIN;
+      }
+   }
+   return 0;
+}
+
+/** note: reserve room for more tasks, doubling the array up to MP1_BATCH_MAX.
+ * arrays larger than a page come from vmalloc(): a write() must not ask for a
+ * multi-page physically contiguous allocation. free the array with kvfree(). **/
+static int mp1_batch_grow(struct mp1_batch * batch)
+{
+   struct mp1_slot * slots;
+   unsigned int capacity = batch->capacity ? batch->capacity * 2 : MP1_BATCH_MIN;
+   size_t size = capacity * sizeof(struct mp1_slot);
+
+   if (capacity > MP1_BATCH_MAX) return -E2BIG;
+   slots = size <= PAGE_SIZE ? kmalloc(size, GFP_KERNEL) : vmalloc(size);
+   if (slots == NULL) return -ENOMEM;
+   if (batch->nr) memcpy(slots, batch->slots, batch->nr * sizeof(struct mp1_slot));
+   kvfree(batch->slots);
+   batch->slots = slots;
+   batch->capacity = capacity;
+   return 0;
+}
+
+/* note: drop the tasks collected after the first nr ones */
+static void mp1_batch_truncate(struct mp1_batch * batch, unsigned int nr)
+{
+   while (batch->nr > nr)
+   {
+      put_task_struct(batch->slots[--batch->nr].task);
+   }
+}
+
+/* note: caller must hold rcu_read_lock(). returns -ENOSPC when the batch is full */
+static int mp1_batch_add(struct mp1_batch * batch, struct task_struct * task)
+{
+   if (batch->nr == batch->capacity) return -ENOSPC;
+   get_task_struct(task);
+   batch->slots[batch->nr].task = task;
+   batch->slots[batch->nr].options = batch->options;
+   batch->nr++;
+   return 0;
+}
+
+/** note: parse one key=value token into options.
+ *   budget=B/W   allow B ms of CPU time per window of W ms, budget=0 removes the budget
+ *   interval=MS  sample in the class with this interval, interval=0 is the default class **/
+static int mp1_parse_option(struct mp1_options * options, char * token)
+{
+   char *value = strchr(token, '=');
+   char *window;
+   unsigned long budget_ms, window_ms = 0, class_ms;
+   unsigned int i;
+
+   *value++ = '\0';
+   if (!strcmp(token, "budget"))
+   {
+      window = strchr(value, '/');
+      if (window != NULL) *window++ = '\0';
+      if (kstrtoul(value, 0, &budget_ms)) return -EINVAL;
+      if (budget_ms != 0 && (window == NULL || kstrtoul(window, 0, &window_ms) || window_ms == 0)) return -EINVAL;
+      options->set |= MP1_OPTION_BUDGET;
+      options->budget_ns = (u64)budget_ms * NSEC_PER_MSEC;
+      options->window_ns = (u64)window_ms * NSEC_PER_MSEC;
+      return 0;
+   }
+   if (!strcmp(token, "interval"))
+   {
+      if (kstrtoul(value, 0, &class_ms)) return -EINVAL;
+      /* note: interval=0 selects the default class */
+      for (i = 0; i < mp1_nr_classes; i++)
+      {
+         if (class_ms == 0 || mp1_classes[i].interval_ms == class_ms)
+         {
+            options->set |= MP1_OPTION_CLASS;
+            options->class = i;
+            return 0;
+         }
+      }
+      printk(KERN_ALERT "no sampling class with interval %lu ms.\n", class_ms);
+      return -EINVAL;
+   }
+   return -EINVAL;
+}
+
+/* note: a registered entry must be passed with its bucket lock held */
+static void mp1_apply_options(struct pid_entry * entry, struct mp1_options * options)
+{
+   if (options->set & MP1_OPTION_BUDGET)
+   {
+      WRITE_ONCE(entry->window_ns, options->window_ns);
+      WRITE_ONCE(entry->budget_ns, options->budget_ns);
+   }
+   if (options->set & MP1_OPTION_CLASS)
+   {
+      if (hlist_unhashed(&entry->class_node))
+      {
+         /* note: not registered yet, mp1_add_class() will use it */
+         entry->class = options->class;
+      }
+      else
+      {
+         mp1_move_class(entry, options->class);
+      }
+   }
+}
+
+/** note: add the tasks selected by one token to batch. caller must hold rcu_read_lock().
+ *   N, pid:N     process N
+ *   pgid:N       every process of process group N
+ *   sid:N        every process of session N
+ *   threads:N    every thread of process N
+ * selectors naming no existing process are ignored. **/
+static int mp1_collect(struct mp1_batch * batch, char * token)
+{
+   struct task_struct *task, *t;
+   struct pid *pid;
+   enum pid_type type = PIDTYPE_PID;
+   bool threads = false;
+   long nr;
+   int ret;
+
+   if (!strncmp(token, "pid:", 4))
+   {
+      token += 4;
+   }
+   else if (!strncmp(token, "pgid:", 5))
+   {
+      type = PIDTYPE_PGID;
+      token += 5;
+   }
+   else if (!strncmp(token, "sid:", 4))
+   {
+      type = PIDTYPE_SID;
+      token += 4;
    }
+   else if (!strncmp(token, "threads:", 8))
+   {
+      threads = true;
+      token += 8;
+   }
+   if (kstrtol(token, 0, &nr) || nr <= 0 || nr > INT_MAX) return -EINVAL;
+
+   pid = find_vpid((int)nr);
+   if (type != PIDTYPE_PID)
+   {
+      do_each_pid_task(pid, type, task)
+      {
+         ret = mp1_batch_add(batch, task);
+         if (ret) return ret;
+      } while_each_pid_task(pid, type, task);
+      return 0;
+   }
+
+   task = pid_task(pid, PIDTYPE_PID);
+   if (task == NULL) return 0;
+   /* note: a thread group has a single entry, pinned on its leader, when thread_group=1 */
+   if (thread_group) return mp1_batch_add(batch, task->group_leader);
+   if (!threads) return mp1_batch_add(batch, task);
+   for_each_thread(task, t)
+   {
+      ret = mp1_batch_add(batch, t);
+      if (ret) return ret;
+   }
+   return 0;
+}
+
+static int mp1_slot_cmp(const void * a, const void * b)
+{
+   u32 x = hash_min(((const struct mp1_slot *)a)->entry->pid, MP1_HASH_BITS);
+   u32 y = hash_min(((const struct mp1_slot *)b)->entry->pid, MP1_HASH_BITS);
+
+   return x < y ? -1 : x > y;
+}
+
+/** note: turn every collected task into an entry and insert them all. the
+ * entries are sorted by bucket first, so each bucket lock is taken only once
+ * for the whole batch. already registered PIDs are skipped. **/
+static void mp1_register_batch(struct mp1_batch * batch)
+{
+   struct task_struct * task;
+   struct pid_entry * entry;
+   struct pid_entry * existing;
+   unsigned int i, nr = 0;
+   u32 bucket;
+
+   /* section: allocate entries, in place of the task pointers */
+   for (i = 0; i < batch->nr; i++)
+   {
+      task = batch->slots[i].task;
+      entry = kmem_cache_zalloc(mp1_entries_slab, GFP_KERNEL);
+      if (entry == NULL)
+      {
+         printk(KERN_ALERT "unable to alloc pid_entry.\n");
+         put_task_struct(task);
+         continue;
+      }
+      spin_lock_init(&entry->sample_lock);
+      if (cpu_breakdown)
+      {
+         entry->cpu_stats = alloc_percpu(struct mp1_cpu_stats);
+         if (entry->cpu_stats == NULL)
+         {
+            printk(KERN_ALERT "unable to alloc cpu_stats.\n");
+            put_task_struct(task);
+            kmem_cache_free(mp1_entries_slab, entry);
+            continue;
+         }
+      }
+      if (thread_group)
+      {
+         /* note: the entry is keyed by the thread group id so the tracepoints can find it */
+         entry->pid = task->tgid;
+         rcu_read_lock();
+         mp1_group_init(entry, task);
+         rcu_read_unlock();
+      }
+      else
+      {
+         entry->pid = task->pid;
+      }
+      entry->task = task;
+      mp1_apply_options(entry, &batch->slots[i].options);
+      batch->slots[nr].entry = entry;
+      batch->slots[nr].options = batch->slots[i].options;
+      nr++;
+   }
+   batch->nr = nr;
 
-   printk(KERN_ALERT "copy from user.\n");
-   if (copy_from_user(input_str, ubuf, size))
+   /* section: insert, one lock acquisition per bucket */
+   sort(batch->slots, batch->nr, sizeof(struct mp1_slot), mp1_slot_cmp, NULL);
+   for (i = 0; i < batch->nr; )
    {
-      printk(KERN_ALERT "copy from user error.\n");
-      return EFAULT;
+      bucket = hash_min(batch->slots[i].entry->pid, MP1_HASH_BITS);
+      spin_lock(&mp1_bucket_locks[bucket]);
+      for (; i < batch->nr && hash_min(batch->slots[i].entry->pid, MP1_HASH_BITS) == bucket; i++)
+      {
+         entry = batch->slots[i].entry;
+         existing = mp1_lookup(entry->pid);
+         if (existing != NULL)
+         {
+            /* note: registering a PID again only updates its options */
+            mp1_apply_options(existing, &batch->slots[i].options);
+            put_task_struct(entry->task);
+            free_percpu(entry->cpu_stats);
+            kmem_cache_free(mp1_entries_slab, entry);
+            continue;
+         }
+         /** note: counted before it is hashed, the exit probe returns early while
+          * mp1_nr_entries is 0 and must not miss the process of this entry **/
+         atomic_inc(&mp1_nr_entries);
+         hash_add_rcu(mp1_entries, &entry->node, entry->pid);
+         mp1_add_class(entry);
+         /** note: the process may have started to exit before the insertion,
+          * when the exit probe could not see its entry yet. do_exit() has a full
+          * barrier between setting PF_EXITING and running the probe, so either
+          * the probe sees the count and finds the entry, or the check below sees
+          * the process dying. the bucket lock is still held, so nobody else can
+          * have removed it. **/
+         smp_mb();
+         if (mp1_entry_dead(entry))
+         {
+            mp1_unlink(entry);
+            atomic_dec(&mp1_nr_entries);
+            call_rcu(&entry->rcu, mp1_free_entry);
+         }
+      }
+      spin_unlock(&mp1_bucket_locks[bucket]);
+   }
+}
+
+/** note: a write registers every process selected by its whitespace or comma
+ * separated tokens (see mp1_collect). at most MP1_WRITE_CHUNK bytes are taken
+ * per call; a longer write is cut after its last complete token and the
+ * number of bytes consumed is returned, so write() loops continue with the rest.
+ * options do not carry over to the next call, so they are rejected in a call
+ * that does not take the rest of the write: a write with options must fit in
+ * one chunk. a malformed token rejects the whole call and registers nothing. **/
+ssize_t mp1_write(struct file * file, const char __user * ubuf, size_t size, loff_t * pos)
+{
+   struct mp1_batch batch = { .slots = NULL };
+   char *buf, *cursor, *token;
+   size_t length = min_t(size_t, size, MP1_WRITE_CHUNK);
+   unsigned int start;
+   int ret = 0;
+
+   buf = kmalloc(length + 1, GFP_KERNEL);
+   if (buf == NULL) return -ENOMEM;
+   if (copy_from_user(buf, ubuf, length))
+   {
+      kfree(buf);
+      return -EFAULT;
    }
+   buf[length] = '\0';
 
-   /* transform string into integer */
-   if (kstrtol(input_str, 0, &pid))
+   /* section: leave a token cut by the chunk boundary for the next write() */
+   if (length < size)
    {
-      printk(KERN_ALERT "get invalid PID.\n");
-      return (ssize_t)size;
-   } else {
-      printk(KERN_ALERT "get PID: %ld.\n", pid);
+      while (length > 0 && strchr(MP1_SEPARATORS, buf[length - 1]) == NULL) length--;
+      if (length == 0)
+      {
+         kfree(buf);
+         return -EINVAL;
+      }
+      buf[length] = '\0';
    }
 
-   printk(KERN_ALERT "creating new entry.\n");
-   new_entry = kzalloc(sizeof(struct pid_entry), GFP_KERNEL);
-   if (!new_entry)
+   /* section: collect and pin the selected tasks */
+   cursor = buf;
+   while ((token = strsep(&cursor, MP1_SEPARATORS)) != NULL)
    {
-      printk(KERN_ALERT "unable to alloc new_entry.\n");
-      return (ssize_t)size;
+      if (*token == '\0') continue;
+      if (strchr(token, '=') != NULL)
+      {
+         /* note: the processes of the next call would lose the option */
+         ret = length < size ? -EINVAL : mp1_parse_option(&batch.options, token);
+         if (ret)
+         {
+            printk(KERN_ALERT "invalid option '%s'.\n", token);
+            break;
+         }
+         continue;
+      }
+      do {
+         start = batch.nr;
+         rcu_read_lock();
+         ret = mp1_collect(&batch, token);
+         rcu_read_unlock();
+         if (ret == -ENOSPC)
+         {
+            /* note: the selector did not fit, grow the batch and collect it again */
+            mp1_batch_truncate(&batch, start);
+            ret = mp1_batch_grow(&batch);
+            if (ret == 0) ret = -ENOSPC;
+         }
+      } while (ret == -ENOSPC);
+      if (ret)
+      {
+         printk(KERN_ALERT "invalid registration '%s': %d.\n", token, ret);
+         break;
+      }
    }
-   new_entry->pid = pid;
-   new_entry->cpu_use = 0;
-   INIT_LIST_HEAD(&(new_entry->ptrs));
+   kfree(buf);
 
-   printk(KERN_ALERT "add new entry to list.\n");
-   mutex_lock(&linked_list_mutex);
-   list_add(&(new_entry->ptrs), &mp1_entries);
-   mutex_unlock(&linked_list_mutex);
+   /* section: register the whole batch */
+   if (ret)
+   {
+      mp1_batch_truncate(&batch, 0);
+   }
+   else
+   {
+      mp1_register_batch(&batch);
+   }
+   kvfree(batch.slots);
 
-   return (ssize_t)size;
+   return ret ? ret : (ssize_t)length;
 }
 
 void mp1_work_function(struct work_struct * work) 
 {
-   struct list_head *pos, *q;
+   struct mp1_shard * shard = container_of(work, struct mp1_shard, work);
+   struct mp1_class * class = shard->class;
    struct pid_entry *tmp;
    unsigned long cpu_use;
-   printk(KERN_ALERT "work function activated.\n");
-   mutex_lock(&linked_list_mutex);
-   list_for_each_safe(pos, q, &mp1_entries)
+   u64 now, cpu_ns;
+   rcu_read_lock();
+   hlist_for_each_entry_rcu(tmp, &shard->entries, class_node)
    {
-      tmp = list_entry(pos, struct pid_entry, ptrs);
-      if(get_cpu_use(tmp->pid, &cpu_use))
+      /* note: exited processes are normally retired by mp1_probe_process_exit() already */
+      if (mp1_entry_dead(tmp))
+      {
+         /* note: hlist_del_init_rcu() keeps tmp->class_node.next valid, so the walk can continue */
+         mp1_remove(tmp);
+         continue;
+      }
+      /* note: a class move is in progress and the other walker is sampling it, skip it this pass */
+      if (!spin_trylock(&tmp->sample_lock)) continue;
+      now = ktime_get_ns();
+      if (accounting)
       {
-         printk(KERN_ALERT "pid not exist: %ld.\n", tmp->pid);
-         /* note: delete instance if the process no longer exists */
-         list_del(pos);
-         kfree(tmp);
+         mp1_sample_ns(tmp);
+         cpu_ns = tmp->runtime_ns;
       }
       else 
       {
-         tmp->cpu_use = cpu_use;
-         printk(KERN_ALERT "update process id %ld's CPU usage: %lu", tmp->pid, tmp->cpu_use);
+         get_task_cpu_use(tmp->task, &cpu_use);
+         WRITE_ONCE(tmp->cpu_use, cpu_use);
+         cpu_ns = cputime_to_nsecs(cpu_use);
       }
+      mp1_record_sample(tmp, now, cpu_ns);
+      mp1_enforce_budget(tmp, now, cpu_ns);
+      spin_unlock(&tmp->sample_lock);
    }
-   mutex_unlock(&linked_list_mutex);
+   rcu_read_unlock();
+
+   /* section: the last shard to finish ends the pass */
+   if (atomic_dec_return(&class->pending) != 1) return;
+   /* note: the snapshot covers every entry, so only the default class publishes it */
+   if (class == &mp1_classes[0]) mp1_publish_snapshot(ktime_get_ns() - class->pass_start_ns);
+   /* note: only now may the timer start the next pass, mp1_publish_snapshot() has a single writer */
+   smp_mb();
+   atomic_set(&class->pending, 0);
 }
 
-void timer_callback(unsigned long data) {
+static enum hrtimer_restart mp1_class_timer(struct hrtimer * timer)
+{
    /* section: generate new work */
    /* this function is processed in interrupt context */
-   mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-   queue_work(mp1_workqueue, deferred_work);
+   struct mp1_class * class = container_of(timer, struct mp1_class, timer);
+   unsigned int i;
+   hrtimer_forward_now(timer, class->period);
+   /* note: skip this period if the previous pass is still running */
+   if (atomic_cmpxchg(&class->pending, 0, mp1_nr_shards + 1) != 0) return HRTIMER_RESTART;
+   class->pass_start_ns = ktime_get_ns();
+   for (i = 0; i < mp1_nr_shards; i++)
+   {
+      queue_work(mp1_workqueue, &class->shards[i].work);
+   }
+   return HRTIMER_RESTART;
+}
+
+static void mp1_class_init(struct mp1_class * class, unsigned int interval)
+{
+   unsigned int i;
+   class->interval_ms = interval;
+   class->period = ms_to_ktime(interval);
+   atomic_set(&class->pending, 0);
+   for (i = 0; i < mp1_nr_shards; i++)
+   {
+      class->shards[i].class = class;
+      spin_lock_init(&class->shards[i].lock);
+      INIT_HLIST_HEAD(&class->shards[i].entries);
+      INIT_WORK(&class->shards[i].work, mp1_work_function);
+   }
+   hrtimer_init(&class->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   class->timer.function = mp1_class_timer;
 }
 
 // mp1_init - Called when module is loaded
 int __init mp1_init(void)
 {
+   int i;
+   int ret;
+
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE LOADING\n");
    #endif
 
-   /* section: initialization */
-   input_str = NULL;
+   /* section: validate sampling intervals and the snapshot size */
+   if (interval_ms == 0 || snapshot_records == 0) return -EINVAL;
+   for (i = 0; i < nr_classes_param; i++)
+   {
+      if (classes[i] == 0) return -EINVAL;
+   }
 
-   /* section: create target proc file */
-   mp1_dir = proc_mkdir("mp1", NULL);
-   mp1_proc = proc_create("status", 0777, mp1_dir, &mp1_fops);
+   /* section: initialize the lock of each hash bucket */
+   /* note: first of all, a write may come in right after proc_create() and the probes take them too */
+   for (i = 0; i < (1 << MP1_HASH_BITS); i++)
+   {
+      spin_lock_init(&mp1_bucket_locks[i]);
+   }
+
+   /* section: attach the exit tracepoint to retire entries of exited processes */
+   ret = mp1_attach_tracepoint(&mp1_process_exit_tp);
+   if (ret) return ret;
+
+   /* section: attach the runtime tracepoint for thread group accounting */
+   if (thread_group)
+   {
+      accounting = 1;
+      ret = mp1_attach_tracepoint(&mp1_stat_runtime_tp);
+      if (ret)
+      {
+         mp1_detach_all_tracepoints();
+         return ret;
+      }
+   }
+
+   /* section: attach the scheduler tracepoints for the per-CPU breakdown */
+   if (cpu_breakdown)
+   {
+      ret = mp1_attach_tracepoint(&mp1_sched_switch_tp);
+      if (!ret) ret = mp1_attach_tracepoint(&mp1_migrate_task_tp);
+      if (ret)
+      {
+         mp1_detach_all_tracepoints();
+         return ret;
+      }
+   }
 
-   /* section: create empty linked list */
-   mp1_entries.next = &mp1_entries;
-   mp1_entries.prev = &mp1_entries;
+   /* section: create slab */
+   mp1_entries_slab = kmem_cache_create("mp1_pid_entry slab", sizeof(struct pid_entry), 0, SLAB_HWCACHE_ALIGN, NULL);
+   if (!mp1_entries_slab)
+   {
+      mp1_detach_all_tracepoints();
+      return -ENOMEM;
+   }
+
+   /* section: create snapshot table */
+   mp1_snapshot_size = PAGE_ALIGN(MP1_SNAPSHOT_BYTES(snapshot_records));
+   mp1_snapshot = vmalloc(mp1_snapshot_size);
+   if (mp1_snapshot == NULL)
+   {
+      kmem_cache_destroy(mp1_entries_slab);
+      mp1_detach_all_tracepoints();
+      return -ENOMEM;
+   }
+   memset(mp1_snapshot, 0, mp1_snapshot_size);
+   /* note: prevent each page from being swapped out while it is mapped to userspace */
+   for (i = 0; i < mp1_snapshot_size; i += PAGE_SIZE)
+   {
+      SetPageReserved(vmalloc_to_page(mp1_snapshot + i));
+   }
+   ((struct mp1_snapshot_header *)mp1_snapshot)->record_size = sizeof(struct mp1_record);
+   ((struct mp1_snapshot_header *)mp1_snapshot)->header_size = sizeof(struct mp1_snapshot_header);
+   ((struct mp1_snapshot_header *)mp1_snapshot)->max_records = snapshot_records;
 
-   /* section: setup timer */
-   setup_timer(&mp1_timer, timer_callback, 0);
-   mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-      /* note: generate new work */
-   deferred_work = kzalloc(sizeof(struct work_struct), GFP_KERNEL);
-   INIT_WORK(deferred_work, mp1_work_function);
+   /* section: initialize sampling classes */
+   mp1_nr_shards = shards ? min_t(unsigned int, shards, MP1_MAX_SHARDS) : min_t(unsigned int, num_online_cpus(), MP1_MAX_SHARDS);
+   mp1_class_init(&mp1_classes[0], interval_ms);
+   for (i = 0; i < nr_classes_param; i++)
+   {
+      mp1_class_init(&mp1_classes[i + 1], classes[i]);
+   }
+   mp1_nr_classes = nr_classes_param + 1;
 
    /* section: create workqueue */
-   mp1_workqueue = create_workqueue("mp1_workqueue");
+   /* note: before the timers, so that their first expiry has somewhere to queue work */
+   /* note: unbound, so the shards of a pass run on any idle CPU instead of the one the timer fired on */
+   mp1_workqueue = alloc_workqueue("mp1_workqueue", WQ_UNBOUND, 0);
+   if (mp1_workqueue == NULL)
+   {
+      for (i = 0; i < mp1_snapshot_size; i += PAGE_SIZE)
+      {
+         ClearPageReserved(vmalloc_to_page(mp1_snapshot + i));
+      }
+      vfree(mp1_snapshot);
+      kmem_cache_destroy(mp1_entries_slab);
+      mp1_detach_all_tracepoints();
+      return -ENOMEM;
+   }
+
+   /* section: create target proc file */
+   mp1_dir = proc_mkdir("mp1", NULL);
+   mp1_proc = proc_create("status", 0777, mp1_dir, &mp1_fops);
+   mp1_snapshot_proc = proc_create("snapshot", 0444, mp1_dir, &mp1_snapshot_fops);
+   mp1_history_proc = proc_create("history", 0444, mp1_dir, &mp1_history_fops);
+
+   /* section: setup timers */
+   for (i = 0; i < mp1_nr_classes; i++)
+   {
+      hrtimer_start(&mp1_classes[i].timer, mp1_classes[i].period, HRTIMER_MODE_REL);
+   }
 
    printk(KERN_ALERT "MP1 MODULE LOADED\n");
    return 0;   
@@ -207,43 +1578,59 @@ int __init mp1_init(void)
 // mp1_exit - Called when module is unloaded
 void __exit mp1_exit(void)
 {
-   struct list_head *pos, *q;
+   struct hlist_node *q;
    struct pid_entry *tmp;
+   int bkt;
+   int i;
 
    #ifdef DEBUG
    printk(KERN_ALERT "MP1 MODULE UNLOADING\n");
    #endif
 
+   /* section: remove target proc file */
+   /* note: remove_proc_entry() waits for running reads and writes, so no new entry can be added below */
+   remove_proc_entry("history", mp1_dir);
+   remove_proc_entry("snapshot", mp1_dir);
+   remove_proc_entry("status", mp1_dir);
+   remove_proc_entry("mp1", NULL);
+
+   /* section: delete timers */
+   /* note: the timers go before the workqueue so that they cannot queue work on a destroyed workqueue */
+   for (i = 0; i < mp1_nr_classes; i++)
+   {
+      hrtimer_cancel(&mp1_classes[i].timer);
+   }
+
    /* section: delete workqueue */
    flush_workqueue(mp1_workqueue);
    destroy_workqueue(mp1_workqueue);
-   kfree(deferred_work);
 
-   /* section: delete timer */
-   del_timer_sync(&mp1_timer);
+   /* section: detach tracepoints */
+   /* note: wait for running probes before their entries are freed */
+   mp1_detach_all_tracepoints();
 
-   /* section: delete linked list */
-   mutex_lock(&linked_list_mutex);
-   list_for_each_safe(pos, q, &mp1_entries)
+   /* section: delete hash table */
+   rcu_read_lock();
+   hash_for_each_safe(mp1_entries, bkt, q, tmp, node)
    {
-      tmp = list_entry(pos, struct pid_entry, ptrs);
-      printk(KERN_ALERT "freeing entry pid = %ld.\n", tmp->pid);
-      list_del(pos);
-      kfree(tmp);
+      /* note: never leave a process stopped or deprioritized behind */
+      if (tmp->throttled && !mp1_entry_dead(tmp)) mp1_unthrottle(tmp);
+      mp1_remove(tmp);
    }
-   mutex_unlock(&linked_list_mutex);
+   rcu_read_unlock();
+   /* note: wait for the pending mp1_free_entry() callbacks */
+   rcu_barrier();
 
-   /* section: free global pointers */
-   if (input_str != NULL)
+   /* section: destroy slab */
+   printk(KERN_ALERT "destroy slab\n");
+   kmem_cache_destroy(mp1_entries_slab);
+
+   /* section: free snapshot table */
+   for (i = 0; i < mp1_snapshot_size; i += PAGE_SIZE)
    {
-      printk(KERN_ALERT "input_str is not null, free it.\n");
-      kfree(input_str);
-      input_str = NULL;
+      ClearPageReserved(vmalloc_to_page(mp1_snapshot + i));
    }
-
-   /* section: remove target proc file */
-   remove_proc_entry("status", mp1_dir);
-   remove_proc_entry("mp1", NULL);
+   vfree(mp1_snapshot);
 
    printk(KERN_ALERT "MP1 MODULE UNLOADED\n");
 }
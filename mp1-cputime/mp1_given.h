@@ -25,4 +25,18 @@ int get_cpu_use(int pid, unsigned long *cpu_use)
    }
 }
 
+//THIS FUNCTION RETURNS THE CPU TIME OF AN ALREADY REFERENCED TASK BY THE PARAMETER CPU_USE, WITHOUT LOOKING UP ITS PID
+void get_task_cpu_use(struct task_struct *task, unsigned long *cpu_use)
+{
+   *cpu_use=task->utime;
+}
+
+//THIS FUNCTION RETURNS THE USER TIME, SYSTEM TIME AND SCHEDULER RUNTIME OF AN ALREADY REFERENCED TASK IN NANOSECONDS
+void get_task_cpu_use_ns(struct task_struct *task, u64 *utime, u64 *stime, u64 *runtime)
+{
+   *utime=cputime_to_nsecs(task->utime);
+   *stime=cputime_to_nsecs(task->stime);
+   *runtime=task->se.sum_exec_runtime;
+}
+
 #endif
@@ -0,0 +1,43 @@
+#ifndef __MP1_SNAPSHOT_INCLUDE__
+#define __MP1_SNAPSHOT_INCLUDE__
+
+/** note: binary layout of /proc/mp1/snapshot, shared by the module and userspace.
+ * the file starts with a struct mp1_snapshot_header, followed by nr_records
+ * records of record_size bytes each, starting at offset header_size.
+ *
+ * sequence works like a seqcount: the work function makes it odd before it
+ * rewrites the table and even again afterwards. a reader of the mmap()ed table
+ * copies the records and retries if sequence was odd or has changed.
+ * read() does the same in the kernel and always returns a consistent table.
+ *
+ * the table has room for max_records records (module parameter snapshot_records),
+ * so it is MP1_SNAPSHOT_BYTES(max_records) long. a reader learns max_records from
+ * a read() of just the header. processes that did not fit in the last pass are
+ * counted in nr_dropped. **/
+
+#include <linux/types.h>
+
+struct mp1_snapshot_header {
+   __u32 sequence;
+   __u32 nr_records;
+   __u32 record_size;
+   __u32 header_size;
+   __u64 generation;    /* number of completed sampling passes */
+   __u64 timestamp_ns;  /* CLOCK_MONOTONIC time of the last sampling pass */
+   __u64 pass_ns;       /* wall time the last sampling pass took, publishing excluded */
+   __u32 max_records;   /* room of the table, in records */
+   __u32 nr_dropped;    /* registered processes left out of the last pass for lack of room */
+};
+
+struct mp1_record {
+   __s32 pid;        /* in the initial pid namespace, whoever maps the table */
+   __u32 util;       /* utilization of the last interval, per-mille of one CPU */
+   __u64 cpu_use;
+   __u32 util_ewma;  /* EWMA of util, per-mille of one CPU */
+   __u32 reserved;
+};
+
+#define MP1_SNAPSHOT_BYTES(max_records) \
+   (sizeof(struct mp1_snapshot_header) + (size_t)(max_records) * sizeof(struct mp1_record))
+
+#endif
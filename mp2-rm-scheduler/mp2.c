@@ -5,20 +5,33 @@
 #include <linux/kernel.h>
 
 #include <linux/fs.h>
+#include <linux/miscdevice.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/workqueue.h>
 #include <linux/mutex.h>
 #include <linux/string.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 
 #include <linux/kthread.h>
 
 #include <linux/ktime.h>
 
 #include "mp2_given.h"
+#include "mp2_ioctl.h"
+#include "mp2_core.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tse-Jui Huang");
@@ -26,35 +39,140 @@ MODULE_DESCRIPTION("CS-423 MP2");
 
 #define DEBUG 1
 
+/* note: the dispatchers must be able to preempt the real-time processes of their CPU */
+#define MP2_DISPATCHER_PRIORITY (MAX_USER_RT_PRIO - 1)
+#define MP2_PROCESS_PRIORITY (MAX_USER_RT_PRIO - 2)
+
+#define MP2_OVERRUN_NONE 0
+#define MP2_OVERRUN_SUSPEND 1
+#define MP2_OVERRUN_CBS 2
+
+/* note: 2^MP2_HASH_BITS buckets in the PID index */
+#define MP2_HASH_BITS 8
+
+/* note: bucket 0 counts times below 1 us, bucket i times in [2^(i-1), 2^i) us, the last one everything above */
+#define MP2_HIST_BUCKETS 32
+
+/* section: module parameters */
+
+static char * policy = "rm";
+module_param(policy, charp, 0444);
+MODULE_PARM_DESC(policy, "scheduling policy, rm (rate-monotonic, default) or edf (earliest deadline first)");
+
+static char * overrun = "suspend";
+module_param(overrun, charp, 0444);
+MODULE_PARM_DESC(overrun, "what happens to a job that runs past its comp_time, none, suspend (until its next release, default) or cbs (postpone its deadline, edf only)");
+
+static bool exact_admission = true;
+module_param(exact_admission, bool, 0644);
+MODULE_PARM_DESC(exact_admission, "when the utilization bound fails, admit task sets that pass response time analysis (default 1)");
+
 /* section: type definition */
 
+/** note: timing statistics of one process. the counters are per CPU, so the
+ * dispatcher and yield_cpu() update them without any lock or shared cache line;
+ * readers sum them over all CPUs. **/
+struct mp2_stats {
+    u64 latency[MP2_HIST_BUCKETS];   /* release to first dispatch of a job */
+    u64 response[MP2_HIST_BUCKETS];  /* release to yield of a job */
+    u64 jobs;
+    u64 misses;
+    u64 overruns;
+};
+
 struct mp2_process_entry {
     struct list_head ptrs;
+    /* note: node in mp2_pid_table, unhashed once the process is deregistered */
+    struct hlist_node pid_node;
+    struct rcu_head rcu;
+    /* note: node in the ready queue, empty while the process is not runnable */
+    struct rb_node ready_node;
     struct task_struct * linux_task;
-    struct timer_list wakeup_timer;
-    int timer_postpone;
+    struct hrtimer wakeup_timer;
+    /* note: node in release_queue, release_pending is set while it is queued */
+    struct llist_node release_node;
+    atomic_t release_pending;
     unsigned long pid;
     unsigned long period;
     unsigned long comp_time;
     long state;
-    unsigned long original_arrived_time;
+    /* note: absolute CLOCK_MONOTONIC release time of the current job, of the next one after a yield */
+    ktime_t release_time;
+    /* note: absolute deadline of the queued job, release_time + period, set when it enters the ready queue */
+    ktime_t deadline;
+    /* note: comp_time / period, rounded up */
+    unsigned long utilization;
+    /* note: the CPU this process is partitioned to */
+    unsigned int cpu;
+    /* note: whether the current job has been dispatched, for the release to dispatch latency */
+    int job_dispatched;
+    struct mp2_stats __percpu * stats;
+    /** note: budget enforcement. budget is the CPU time left to the current job, it is
+     * refilled to comp_time at each release and charged whenever the process stops running.
+     * budget_timer is armed at dispatch and fires when the budget runs out, it only sets
+     * budget_exhausted and requests a dispatch; the dispatcher handles the overrun. **/
+    struct hrtimer budget_timer;
+    atomic_t budget_exhausted;
+    s64 budget;
+    ktime_t dispatched_at;
+    /* note: the /dev/mp2 file the process registered through, NULL for /proc/mp2/status */
+    struct file * file;
+};
+
+/** note: scheduling state of one CPU. every CPU has its own dispatcher thread,
+ * ready queue and release queue, and only schedules the processes admitted to it.
+ * runnable processes (state == TASK_RUNNING) are kept in an rbtree ordered by
+ * period, so the dispatcher finds the highest priority one without walking the
+ * process list. the leftmost node is cached, which makes the lookup O(1). the
+ * queue and the state field are protected by ready_queue_lock. **/
+struct mp2_cpu {
+    unsigned int cpu;
+    struct task_struct * dispatching_thread;
+    struct mp2_process_entry * running_process;
+    struct mp2_core_queue ready_queue;
+    spinlock_t ready_queue_lock;
+    /** note: timer_callback runs in interrupt context, so it only pushes the released
+     * process onto this lock-free list. the dispatcher moves the released processes
+     * into the ready queue before each dispatch decision. **/
+    struct llist_head release_queue;
+    /* note: set by anyone who needs a dispatch decision, cleared by the dispatcher */
+    atomic_t dispatch_requested;
+    /* note: sum of the utilization of the processes on this CPU, protected by process_list_mutex */
+    unsigned long total_utilization;
+    unsigned int nr_processes;
 };
 
 /* section: function delcaration */
 
 static int mp2_show(struct seq_file * m, void * v);
 static int mp2_open(struct inode *inode, struct file *file);
-static void timer_callback(unsigned long data);
-static int admission_control(unsigned long period, unsigned long comp_time);
-static int registration(unsigned long pid, unsigned long period, unsigned long comp_time);
+static int mp2_stats_show(struct seq_file * m, void * v);
+static int mp2_stats_open(struct inode *inode, struct file *file);
+static enum hrtimer_restart timer_callback(struct hrtimer * timer);
+static enum hrtimer_restart budget_timer_callback(struct hrtimer * timer);
+static int admission_control(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * new_process);
+static int exact_admission_test(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * new_process);
+static int registration(unsigned long pid, unsigned long period, unsigned long comp_time, struct file * file, ktime_t * release_time);
+static struct mp2_process_entry * mp2_find_entry(unsigned long pid);
+static int yield_entry(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * tmp);
+static void yield_sleep(struct mp2_cpu * mp2_cpu, unsigned long pid, int running);
 static int yield_cpu(unsigned long pid);
+static struct mp2_cpu * deregister_entry(struct mp2_process_entry * tmp);
 static int deregistration(unsigned long pid);
 static ssize_t mp2_write(struct file * file, const char __user * ubuf, size_t size, loff_t * pos);
+static long mp2_dev_ioctl(struct file * file, unsigned int cmd, unsigned long arg);
+static int mp2_dev_open(struct inode * inode, struct file * file);
+static int mp2_dev_release(struct inode * inode, struct file * file);
 static int dispatching_func(void * data);
+static void ready_queue_insert(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * process);
+static void ready_queue_erase(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * process);
+static void drain_release_queue(struct mp2_cpu * mp2_cpu);
+static void request_dispatch(struct mp2_cpu * mp2_cpu);
 
 /* section: variable declaration & initialization */
 
 static struct proc_dir_entry * mp2_proc;
+static struct proc_dir_entry * mp2_stats_proc;
 static struct proc_dir_entry * mp2_dir;
 static char * input_str;
 
@@ -63,6 +181,19 @@ static struct list_head mp2_process_entries;
 
 DEFINE_MUTEX(process_list_mutex);
 
+/** note: registered processes are also indexed by PID. yields look their entry up
+ * under rcu_read_lock() and never take process_list_mutex; registration and
+ * deregistration change the index under the mutex and free entries after a grace period. **/
+static DEFINE_HASHTABLE(mp2_pid_table, MP2_HASH_BITS);
+
+/* note: parsed from the policy and overrun parameters at load time */
+static int mp2_policy = MP2_POLICY_RM;
+static int mp2_overrun = MP2_OVERRUN_SUSPEND;
+
+static DEFINE_PER_CPU(struct mp2_cpu, mp2_cpus);
+/* note: the CPUs online at load time, processes are partitioned onto them */
+static struct cpumask mp2_cpumask;
+
 static const struct file_operations mp2_fops = {
     .owner = THIS_MODULE,
     .open = mp2_open,
@@ -72,8 +203,30 @@ static const struct file_operations mp2_fops = {
     .write = mp2_write
 };
 
-static struct task_struct * dispatching_thread;
-static struct mp2_process_entry * running_process = NULL;
+static const struct file_operations mp2_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = mp2_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations mp2_dev_fops = {
+    .owner = THIS_MODULE,
+    .open = mp2_dev_open,
+    .release = mp2_dev_release,
+    .unlocked_ioctl = mp2_dev_ioctl,
+    .compat_ioctl = mp2_dev_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice mp2_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "mp2",
+    .fops = &mp2_dev_fops,
+    .mode = 0666,
+};
+
 static struct timespec64 current_time;
 
 /* section: function definition */
@@ -87,7 +240,7 @@ static int mp2_show(struct seq_file * m, void * v)
     mutex_lock(&process_list_mutex);
     list_for_each_safe(pos, q, &mp2_process_entries) {
         tmp = list_entry(pos, struct mp2_process_entry, ptrs);
-        seq_printf(m, "%ld %ld %ld\n", tmp->pid, tmp->period, tmp->comp_time);
+        seq_printf(m, "%ld %ld %ld %u\n", tmp->pid, tmp->period, tmp->comp_time, tmp->cpu);
     }
     mutex_unlock(&process_list_mutex);
     return 0;
@@ -98,166 +251,464 @@ static int mp2_open(struct inode *inode, struct file *file)
     return single_open(file, mp2_show, NULL);
 }
 
-static void timer_callback(unsigned long data)
+static inline struct mp2_cpu * mp2_cpu_of(struct mp2_process_entry * process)
 {
-    /* warning: in interrupt context */
+    return per_cpu_ptr(&mp2_cpus, process->cpu);
+}
 
-    struct mp2_process_entry * process = (struct mp2_process_entry *)data;
+/* note: caller must hold rcu_read_lock() or process_list_mutex */
+static struct mp2_process_entry * mp2_find_entry(unsigned long pid)
+{
+    struct mp2_process_entry * tmp;
 
-    /** note: timer_postpone is used when two timers arrive simultaneously.
-     * if two call_back functions are trigered too close, dispatch thread
-     * will only process once. To avoid this situation, if wake_up_process()
-     * returns 1, the another timer_callback is needed, instead of spinning
-     * this function call. This is because that timer_callback is in interrupt
-     * mode, spinning will cause starvation to all the other processes. **/
-    if (process->timer_postpone == 1)
+    hash_for_each_possible_rcu(mp2_pid_table, tmp, pid_node, pid)
     {
-        /* note: postponed timer_callback runs here */
-        if (!wake_up_process(dispatching_thread))
-        {
-            /* note: timer should be postponed again for a while */
-            mod_timer(&process->wakeup_timer, jiffies + msecs_to_jiffies(2));
-        }
-        else
-        {
-            process->timer_postpone = 0;
-            printk(KERN_ALERT "tmcbk: %ld: postponed timer wake up dispatch thread\n", process->pid);
-        }
-        
-    } 
-    else
+        if (tmp->pid == pid) return tmp;
+    }
+    return NULL;
+}
+
+static void mp2_free_entry(struct rcu_head * rcu)
+{
+    struct mp2_process_entry * tmp = container_of(rcu, struct mp2_process_entry, rcu);
+
+    if (tmp->linux_task != NULL) put_task_struct(tmp->linux_task);
+    free_percpu(tmp->stats);
+    kmem_cache_free(mp2_process_entries_slab, tmp);
+}
+
+/* note: true while the task of tmp may still be scheduled, false for a dummy or exiting one */
+static inline bool mp2_task_alive(struct mp2_process_entry * tmp)
+{
+    return tmp->linux_task != NULL && !(tmp->linux_task->flags & PF_EXITING);
+}
+
+static inline unsigned int mp2_hist_bucket(s64 ns)
+{
+    u64 us = ns > 0 ? div_u64((u64)ns, NSEC_PER_USEC) : 0;
+    return min_t(unsigned int, fls64(us), MP2_HIST_BUCKETS - 1);
+}
+
+static void mp2_show_hist(struct seq_file * m, struct mp2_process_entry * process, const char * name, size_t offset)
+{
+    unsigned int i;
+    int cpu;
+    u64 count;
+
+    seq_printf(m, "%ld %s", process->pid, name);
+    for (i = 0; i < MP2_HIST_BUCKETS; i++)
     {
-        /* note: the original timer set by yield() */
-        printk(KERN_ALERT "tmcbk: %ld: execute timer callback\n", process->pid);
-        process->state = TASK_RUNNING;
-        if (!wake_up_process(dispatching_thread))
+        count = 0;
+        for_each_possible_cpu(cpu)
         {
-            /* note: timer should be postponed for a while */
-            printk(KERN_ALERT "tmcbk: %ld: dispatch thread is running, postpone 2 ms.\n", process->pid);
-            process->timer_postpone = 1;
-            mod_timer(&process->wakeup_timer, jiffies + msecs_to_jiffies(2));
+            count += ((u64 *)((char *)per_cpu_ptr(process->stats, cpu) + offset))[i];
         }
-        else
+        seq_printf(m, " %llu", count);
+    }
+    seq_putc(m, '\n');
+}
+
+static int mp2_stats_show(struct seq_file * m, void * v)
+{
+    struct mp2_process_entry *tmp;
+    struct mp2_stats * stats;
+    u64 jobs, misses, overruns;
+    int bkt, cpu;
+
+    /* section: sum the per-CPU counters of each process */
+    /* note: walked under RCU, a reader never stalls registration or the dispatchers */
+    rcu_read_lock();
+    hash_for_each_rcu(mp2_pid_table, bkt, tmp, pid_node)
+    {
+        jobs = 0;
+        misses = 0;
+        overruns = 0;
+        for_each_possible_cpu(cpu)
         {
-            printk(KERN_ALERT "tmcbk: %ld: timer wake up dispatch thread\n", process->pid);
+            stats = per_cpu_ptr(tmp->stats, cpu);
+            jobs += stats->jobs;
+            misses += stats->misses;
+            overruns += stats->overruns;
         }
-        
+        seq_printf(m, "%ld jobs %llu misses %llu overruns %llu\n", tmp->pid, jobs, misses, overruns);
+        mp2_show_hist(m, tmp, "latency_us", offsetof(struct mp2_stats, latency));
+        mp2_show_hist(m, tmp, "response_us", offsetof(struct mp2_stats, response));
     }
+    rcu_read_unlock();
+    return 0;
 }
 
-static int admission_control(unsigned long period, unsigned long comp_time)
+static int mp2_stats_open(struct inode *inode, struct file *file)
 {
-    struct list_head *pos, *q;
-    struct mp2_process_entry *tmp;
-    unsigned long total_workload = 0;
+    return single_open(file, mp2_stats_show, NULL);
+}
 
-    /* section: calculate the total workload */
-    mutex_lock(&process_list_mutex);
-    list_for_each_safe(pos, q, &mp2_process_entries)
+/* note: whether process a goes before process b in the ready queue, see mp2_core_before() */
+static int ready_queue_before(const struct rb_node * a, const struct rb_node * b)
+{
+    const struct mp2_process_entry * x = rb_entry(a, struct mp2_process_entry, ready_node);
+    const struct mp2_process_entry * y = rb_entry(b, struct mp2_process_entry, ready_node);
+
+    return mp2_core_before(mp2_policy, ktime_to_ns(x->deadline), x->period, x->pid,
+                           ktime_to_ns(y->deadline), y->period, y->pid);
+}
+
+/** note: caller must hold ready_queue_lock. the key of a queued process must not
+ * change, so its deadline is only set while it is out of the queue. **/
+static void ready_queue_insert(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * process)
+{
+    if (!RB_EMPTY_NODE(&process->ready_node)) return;
+    mp2_core_queue_insert(&mp2_cpu->ready_queue, &process->ready_node, ready_queue_before);
+}
+
+/* note: caller must hold ready_queue_lock */
+static void ready_queue_erase(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * process)
+{
+    if (RB_EMPTY_NODE(&process->ready_node)) return;
+    mp2_core_queue_erase(&mp2_cpu->ready_queue, &process->ready_node);
+    RB_CLEAR_NODE(&process->ready_node);
+}
+
+/** note: caller must hold rcu_read_lock() or process_list_mutex, which keep the released
+ * processes from being freed. a process deregistered meanwhile is unhashed under
+ * ready_queue_lock before it is erased, so it is not queued again. **/
+static void drain_release_queue(struct mp2_cpu * mp2_cpu)
+{
+    struct llist_node * released = llist_del_all(&mp2_cpu->release_queue);
+    struct mp2_process_entry *tmp, *n;
+
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    llist_for_each_entry_safe(tmp, n, released, release_node)
     {
-        tmp = list_entry(pos, struct mp2_process_entry, ptrs);
-        total_workload += (tmp->comp_time * 1000) / tmp->period;
+        atomic_set(&tmp->release_pending, 0);
+        if (hlist_unhashed(&tmp->pid_node)) continue;
+        tmp->state = TASK_RUNNING;
+        tmp->job_dispatched = 0;
+        tmp->budget = tmp->comp_time * NSEC_PER_MSEC;
+        if (!RB_EMPTY_NODE(&tmp->ready_node)) continue;
+        tmp->deadline = ktime_add_ms(tmp->release_time, tmp->period);
+        ready_queue_insert(mp2_cpu, tmp);
     }
-    mutex_unlock(&process_list_mutex);
-    total_workload += (comp_time * 1000) / period;
-    if (total_workload > 693)
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+}
+
+/** note: a request is never lost. if the dispatcher is running, wake_up_process()
+ * does nothing, but the dispatcher sees dispatch_requested before it sleeps again
+ * and runs one more iteration. **/
+static void request_dispatch(struct mp2_cpu * mp2_cpu)
+{
+    atomic_set(&mp2_cpu->dispatch_requested, 1);
+    wake_up_process(mp2_cpu->dispatching_thread);
+}
+
+static enum hrtimer_restart timer_callback(struct hrtimer * timer)
+{
+    /* warning: in interrupt context */
+
+    struct mp2_process_entry * process = container_of(timer, struct mp2_process_entry, wakeup_timer);
+    struct mp2_cpu * mp2_cpu = mp2_cpu_of(process);
+
+    /* note: a process is queued at most once until the dispatcher drains it */
+    if (!atomic_xchg(&process->release_pending, 1))
+    {
+        llist_add(&process->release_node, &mp2_cpu->release_queue);
+    }
+    request_dispatch(mp2_cpu);
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart budget_timer_callback(struct hrtimer * timer)
+{
+    /* warning: in interrupt context */
+
+    struct mp2_process_entry * process = container_of(timer, struct mp2_process_entry, budget_timer);
+
+    atomic_set(&process->budget_exhausted, 1);
+    request_dispatch(mp2_cpu_of(process));
+    return HRTIMER_NORESTART;
+}
+
+/* note: charge the CPU time used since the last dispatch to the budget of process */
+static void charge_budget(struct mp2_process_entry * process, ktime_t now)
+{
+    if (mp2_overrun == MP2_OVERRUN_NONE) return;
+    hrtimer_cancel(&process->budget_timer);
+    process->budget -= ktime_to_ns(ktime_sub(now, process->dispatched_at));
+    if (process->budget < 0) process->budget = 0;
+}
+
+/** note: the running process has used up its budget. with suspend it leaves the ready
+ * queue until its next release, with cbs (constant bandwidth server) its deadline is
+ * postponed by one period and its budget refilled, so that it keeps running at its
+ * reserved bandwidth without taking any from the other processes.
+ * caller must hold rcu_read_lock(), which keeps process from being freed. **/
+static void handle_overrun(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * process)
+{
+    ktime_t now = ktime_get();
+
+    charge_budget(process, now);
+    /* note: the dispatcher charges it again when it stops the process */
+    process->dispatched_at = now;
+    this_cpu_inc(process->stats->overruns);
+
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    if (RB_EMPTY_NODE(&process->ready_node) || hlist_unhashed(&process->pid_node))
+    {
+        /* note: the job has yielded meanwhile, or the process is being deregistered and its timers stopped */
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        return;
+    }
+    ready_queue_erase(mp2_cpu, process);
+    if (mp2_overrun == MP2_OVERRUN_CBS)
+    {
+        process->deadline = ktime_add_ms(process->deadline, process->period);
+        process->budget = process->comp_time * NSEC_PER_MSEC;
+        ready_queue_insert(mp2_cpu, process);
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        printk(KERN_ALERT "overrun: %ld: deadline postponed\n", process->pid);
+        return;
+    }
+    process->state = TASK_INTERRUPTIBLE;
+    /* note: the rest of the job runs from its next release on. under the lock, like a yield */
+    process->release_time = ktime_add_ms(process->release_time, process->period);
+    if (ktime_before(process->release_time, now)) process->release_time = now;
+    hrtimer_start(&process->wakeup_timer, process->release_time, HRTIMER_MODE_ABS);
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+    printk(KERN_ALERT "overrun: %ld: suspended until the next period\n", process->pid);
+}
+
+/** note: collects the task set of mp2_cpu including new_process for mp2_core_exact_test().
+ * only the processes on mp2_cpu interfere with each other.
+ * caller must hold process_list_mutex. **/
+static int exact_admission_test(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * new_process)
+{
+    struct list_head *pos;
+    struct mp2_process_entry *tmp;
+    struct mp2_core_task * tasks;
+    unsigned int n = 0;
+    int ret;
+
+    tasks = kmalloc_array(mp2_cpu->nr_processes + 1, sizeof(struct mp2_core_task), GFP_KERNEL);
+    if (!tasks)
     {
+        printk(KERN_ALERT "kmalloc error\n");
         return 1;
     }
-    else
+
+    /* section: collect the task set of the CPU including the new process */
+    list_for_each(pos, &mp2_process_entries)
     {
-        return 0;
+        tmp = list_entry(pos, struct mp2_process_entry, ptrs);
+        if (tmp->cpu != mp2_cpu->cpu) continue;
+        tasks[n].pid = tmp->pid;
+        tasks[n].period = tmp->period;
+        tasks[n].comp_time = tmp->comp_time;
+        tasks[n].utilization = tmp->utilization;
+        n++;
+    }
+    tasks[n].pid = new_process->pid;
+    tasks[n].period = new_process->period;
+    tasks[n].comp_time = new_process->comp_time;
+    tasks[n].utilization = new_process->utilization;
+    n++;
+
+    ret = mp2_core_exact_test(tasks, n);
+    if (ret)
+    {
+        printk(KERN_ALERT "admission: %lu: response time exceeds period %lu\n", tasks[ret - 1].pid, tasks[ret - 1].period);
     }
+    kfree(tasks);
+    return ret != 0;
 }
 
-static int registration(unsigned long pid, unsigned long period, unsigned long comp_time)
+/* note: whether new_process fits on mp2_cpu. caller must hold process_list_mutex */
+static int admission_control(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * new_process)
+{
+    /* section: utilization tests, O(1) with the running total */
+    int ret = mp2_core_bound_test(mp2_policy, mp2_cpu->total_utilization + new_process->utilization,
+                                  mp2_cpu->nr_processes + 1, exact_admission);
+
+    if (ret != MP2_CORE_EXACT) return ret;
+    return exact_admission_test(mp2_cpu, new_process);
+}
+
+/** note: registers pid, bound to file if it registers through /dev/mp2.
+ * returns the CPU the process is partitioned to, or a negative error code. **/
+/* note: release_time, if not NULL, receives the time the releases of the process are counted from */
+static int registration(unsigned long pid, unsigned long period, unsigned long comp_time, struct file * file, ktime_t * release_time)
 {   
     struct mp2_process_entry * new_process;
+    struct mp2_cpu * mp2_cpu = NULL;
+    unsigned int cpu;
 
-    /* section: admission control */
-    if (admission_control(period, comp_time))
+    if (period == 0 || comp_time == 0 || comp_time > period)
     {
-        printk(KERN_ALERT "prohibited by admission control.\n");
-        return 1;
+        printk(KERN_ALERT "invalid period or computation time.\n");
+        return -EINVAL;
     }
 
     /* section: create new process node */
     new_process = kmem_cache_alloc(mp2_process_entries_slab, GFP_KERNEL);
     if (!new_process) {
         printk(KERN_ALERT "kmem alloc error\n");
-        return 1;
+        return -ENOMEM;
     }
     new_process->pid = pid;
     new_process->period = period;
     new_process->comp_time = comp_time;
+    new_process->utilization = mp2_core_utilization(period, comp_time);
     new_process->linux_task = NULL;
-    new_process->linux_task = find_task_by_pid((unsigned int)pid);
-    new_process->state = TASK_RUNNING;
-    new_process->original_arrived_time = jiffies;
+    atomic_set(&new_process->release_pending, 0);
+    new_process->release_time = ktime_get();
+    if (release_time != NULL) *release_time = new_process->release_time;
+    new_process->job_dispatched = 0;
+    new_process->budget = comp_time * NSEC_PER_MSEC;
+    atomic_set(&new_process->budget_exhausted, 0);
+    RB_CLEAR_NODE(&new_process->ready_node);
+    new_process->stats = alloc_percpu(struct mp2_stats);
+    if (!new_process->stats)
+    {
+        kmem_cache_free(mp2_process_entries_slab, new_process);
+        printk(KERN_ALERT "alloc_percpu error\n");
+        return -ENOMEM;
+    }
+    /** note: pid is in the namespace of the caller, so it is looked up here and not by the dispatcher.
+     * the task is pinned until the entry is freed, so the pointer stays valid after it exits **/
+    rcu_read_lock();
+    new_process->linux_task = pid_task(find_vpid((int)pid), PIDTYPE_PID);
+    if (new_process->linux_task) get_task_struct(new_process->linux_task);
+    rcu_read_unlock();
     if (!new_process->linux_task)
     {
         printk(KERN_ALERT "dummy input\n");
     }
-    /* note: the third parameter is the address of struct mp2_process_entry new_process for callback function to use */
-    setup_timer(&new_process->wakeup_timer, timer_callback, (unsigned long)new_process);
-    mod_timer(&new_process->wakeup_timer, jiffies + msecs_to_jiffies(period));
     INIT_LIST_HEAD(&new_process->ptrs);
+    new_process->file = file;
+
+    /* section: admission control */
+    /** note: first fit, the process goes to the first CPU it is schedulable on.
+     * under the same lock as the insertion, so that concurrent registrations cannot overcommit **/
+    mutex_lock(&process_list_mutex);
+    /* note: a file is bound to one process at a time */
+    if (file != NULL && file->private_data != NULL)
+    {
+        mutex_unlock(&process_list_mutex);
+        mp2_free_entry(&new_process->rcu);
+        printk(KERN_ALERT "rgst: %ld: file already registered\n", pid);
+        return -EBUSY;
+    }
+    if (mp2_find_entry(pid) != NULL)
+    {
+        mutex_unlock(&process_list_mutex);
+        mp2_free_entry(&new_process->rcu);
+        printk(KERN_ALERT "rgst: %ld: already registered\n", pid);
+        return -EEXIST;
+    }
+    for_each_cpu(cpu, &mp2_cpumask)
+    {
+        if (!admission_control(per_cpu_ptr(&mp2_cpus, cpu), new_process))
+        {
+            mp2_cpu = per_cpu_ptr(&mp2_cpus, cpu);
+            break;
+        }
+    }
+    if (mp2_cpu == NULL)
+    {
+        mutex_unlock(&process_list_mutex);
+        mp2_free_entry(&new_process->rcu);
+        printk(KERN_ALERT "prohibited by admission control.\n");
+        return -EBUSY;
+    }
+
+    new_process->cpu = mp2_cpu->cpu;
+
+    /* note: releases are absolute, so jitter does not accumulate from one period to the next */
+    hrtimer_init(&new_process->wakeup_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    new_process->wakeup_timer.function = timer_callback;
+    hrtimer_start(&new_process->wakeup_timer, ktime_add_ms(new_process->release_time, period), HRTIMER_MODE_ABS);
+    hrtimer_init(&new_process->budget_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    new_process->budget_timer.function = budget_timer_callback;
     
     /* section: add into process list */
-    mutex_lock(&process_list_mutex);
     list_add(&new_process->ptrs, &mp2_process_entries);
+    hash_add_rcu(mp2_pid_table, &new_process->pid_node, pid);
+    mp2_cpu->total_utilization += new_process->utilization;
+    mp2_cpu->nr_processes++;
+    /* note: runnable until its first yield */
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    new_process->state = TASK_RUNNING;
+    new_process->deadline = ktime_add_ms(new_process->release_time, period);
+    ready_queue_insert(mp2_cpu, new_process);
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+    if (file != NULL) file->private_data = new_process;
     mutex_unlock(&process_list_mutex);
-    return 0;
+
+    /* section: pin the process to its CPU */
+    if (new_process->linux_task && set_cpus_allowed_ptr(new_process->linux_task, cpumask_of(mp2_cpu->cpu)))
+    {
+        printk(KERN_ALERT "rgst: %ld: unable to set affinity to cpu %u\n", pid, mp2_cpu->cpu);
+    }
+    return mp2_cpu->cpu;
 }
 
-static int yield_cpu(unsigned long pid)
+/** note: ends the current job of tmp and arms the release of the next one, returns -1
+ * if tmp has been deregistered, 1 if it was the running process of its CPU, 0 otherwise.
+ * the ready queue lock of the CPU orders a yield against deregistration, which unhashes
+ * the entry under the same lock before it stops the timers. caller must hold
+ * rcu_read_lock(), which keeps tmp from being freed, and call yield_sleep() after
+ * releasing it. **/
+static int yield_entry(struct mp2_cpu * mp2_cpu, struct mp2_process_entry * tmp)
 {
-    struct list_head *pos, *q;
-    struct mp2_process_entry *tmp;
+    ktime_t now;
+    int running;
 
-    /* section: modify process data of pid */
-    mutex_lock(&process_list_mutex);
-    list_for_each_safe(pos, q, &mp2_process_entries)
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    if (hlist_unhashed(&tmp->pid_node))
     {
-        tmp = list_entry(pos, struct mp2_process_entry, ptrs);
-        if (tmp->pid == pid)
-        {
-            /* note: check if the time has passed or not, reschedule (postpone) or set normally */
-            if (jiffies < tmp->original_arrived_time + msecs_to_jiffies(tmp->period))
-            {
-                mod_timer(&tmp->wakeup_timer, tmp->original_arrived_time + msecs_to_jiffies(tmp->period));
-                tmp->original_arrived_time = tmp->original_arrived_time + msecs_to_jiffies(tmp->period);
-                tmp->timer_postpone = 0; /* note: will be used in timer_callback */
-            }
-            else
-            {
-                printk(KERN_ALERT "yield: %ld: deadline has passed, reschedule.", pid);
-                mod_timer(&tmp->wakeup_timer, jiffies + msecs_to_jiffies(tmp->period));
-                tmp->original_arrived_time = jiffies + msecs_to_jiffies(tmp->period);
-                tmp->timer_postpone = 0;
-            }
-            tmp->state = TASK_INTERRUPTIBLE;
-            set_task_state(tmp->linux_task, TASK_INTERRUPTIBLE);
-            mutex_unlock(&process_list_mutex);
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        return -1;
+    }
 
-            goto success;
-        }
+    /* section: record the response time of the finished job */
+    now = ktime_get();
+    /* note: an overrun noticed too late is not one */
+    hrtimer_cancel(&tmp->budget_timer);
+    atomic_set(&tmp->budget_exhausted, 0);
+    this_cpu_inc(tmp->stats->response[mp2_hist_bucket(ktime_to_ns(ktime_sub(now, tmp->release_time)))]);
+    this_cpu_inc(tmp->stats->jobs);
+    if (!ktime_before(now, ktime_add_ms(tmp->release_time, tmp->period)))
+    {
+        this_cpu_inc(tmp->stats->misses);
     }
-    mutex_unlock(&process_list_mutex);
-    return -1;
 
-success:
-    if (running_process != NULL && running_process->pid == pid)
+    /* note: check if the time has passed or not, reschedule (postpone) or set normally */
+    if (ktime_before(now, ktime_add_ms(tmp->release_time, tmp->period)))
     {
-        running_process = NULL;
-        if (wake_up_process(dispatching_thread))
-        {
-            //printk(KERN_ALERT"yield: %ld: dispatch is already running\n", pid);
-        }
-        else
-        {
-            printk(KERN_ALERT"yield: %ld: wake up dispatch success\n", pid);
-        }
+        tmp->release_time = ktime_add_ms(tmp->release_time, tmp->period);
+        hrtimer_start(&tmp->wakeup_timer, tmp->release_time, HRTIMER_MODE_ABS);
+    }
+    else
+    {
+        printk(KERN_ALERT "yield: %ld: deadline has passed, reschedule.", tmp->pid);
+        tmp->release_time = ktime_add_ms(now, tmp->period);
+        hrtimer_start(&tmp->wakeup_timer, tmp->release_time, HRTIMER_MODE_ABS);
+    }
+    tmp->state = TASK_INTERRUPTIBLE;
+    ready_queue_erase(mp2_cpu, tmp);
+    set_task_state(tmp->linux_task, TASK_INTERRUPTIBLE);
+    /* note: under the lock, running_process is only dereferenced under RCU by the dispatcher */
+    running = mp2_cpu->running_process == tmp;
+    if (running) mp2_cpu->running_process = NULL;
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+    return running;
+}
+
+/* note: running is what yield_entry() returned, the CPU needs a new dispatch if it was set */
+static void yield_sleep(struct mp2_cpu * mp2_cpu, unsigned long pid, int running)
+{
+    if (running)
+    {
+        request_dispatch(mp2_cpu);
     }
     else
     {
@@ -265,37 +716,80 @@ success:
     }
 
     ktime_get_ts64(&current_time);
-    printk(KERN_ALERT "yield: %ld: sleep process pid %lu, time=%ld\n", pid, tmp->pid, current_time.tv_sec);
+    printk(KERN_ALERT "yield: %ld: sleep process pid %lu, time=%ld\n", pid, pid, current_time.tv_sec);
     schedule();
     ktime_get_ts64(&current_time);
+}
+
+static int yield_cpu(unsigned long pid)
+{
+    struct mp2_process_entry *tmp;
+    struct mp2_cpu * mp2_cpu = NULL;
+    int ret = -1;
+
+    /* section: modify process data of pid */
+    rcu_read_lock();
+    tmp = mp2_find_entry(pid);
+    if (tmp != NULL)
+    {
+        mp2_cpu = mp2_cpu_of(tmp);
+        ret = yield_entry(mp2_cpu, tmp);
+    }
+    rcu_read_unlock();
+    if (ret < 0) return -1;
+
+    yield_sleep(mp2_cpu, pid, ret);
     return 0;
 }
 
+/** note: removes tmp and frees it after a grace period, returns the CPU it was on,
+ * which needs a dispatch. caller must hold process_list_mutex **/
+static struct mp2_cpu * deregister_entry(struct mp2_process_entry * tmp)
+{
+    struct mp2_cpu * mp2_cpu = mp2_cpu_of(tmp);
+
+    /* section: unhash, after this no yield or dispatch arms the timers again */
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    hash_del_rcu(&tmp->pid_node);
+    if (mp2_cpu->running_process == tmp) mp2_cpu->running_process = NULL;
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+
+    /* section: delete timer, delete node */
+    printk(KERN_ALERT "drgst: %ld: delete timer\n", tmp->pid);
+    hrtimer_cancel(&tmp->wakeup_timer);
+    hrtimer_cancel(&tmp->budget_timer);
+    //printk(KERN_ALERT "drgst: %ld: delete entry\n", tmp->pid);
+    /* note: the timer may have queued a release just before it was cancelled */
+    drain_release_queue(mp2_cpu);
+    spin_lock(&mp2_cpu->ready_queue_lock);
+    ready_queue_erase(mp2_cpu, tmp);
+    spin_unlock(&mp2_cpu->ready_queue_lock);
+    list_del(&tmp->ptrs);
+    if (tmp->file != NULL) WRITE_ONCE(tmp->file->private_data, NULL);
+    mp2_cpu->total_utilization -= tmp->utilization;
+    mp2_cpu->nr_processes--;
+    /* note: a yield may still be looking at it */
+    call_rcu(&tmp->rcu, mp2_free_entry);
+    return mp2_cpu;
+}
+
 static int deregistration(unsigned long pid)
 {
-    struct list_head *pos, *q;
     struct mp2_process_entry *tmp;
+    struct mp2_cpu * mp2_cpu;
 
     /* section: delete the node belongs to pid */
     mutex_lock(&process_list_mutex);
-    list_for_each_safe(pos, q, &mp2_process_entries)
+    tmp = mp2_find_entry(pid);
+    if (tmp == NULL)
     {
-        tmp = list_entry(pos, struct mp2_process_entry, ptrs);
-        if (tmp->pid == pid)
-        {
-            /* section: delete timer, delete node, and break */
-            printk(KERN_ALERT "drgst: %ld: delete timer\n", tmp->pid);
-            del_timer_sync(&tmp->wakeup_timer);
-            //printk(KERN_ALERT "drgst: %ld: delete entry\n", tmp->pid);
-            list_del(pos);
-            kmem_cache_free(mp2_process_entries_slab, tmp);
-            mutex_unlock(&process_list_mutex);
-            while(!wake_up_process(dispatching_thread));
-            return 0;
-        }
-    }  
+        mutex_unlock(&process_list_mutex);
+        return 1;
+    }
+    mp2_cpu = deregister_entry(tmp);
     mutex_unlock(&process_list_mutex);
-    return 1;
+    request_dispatch(mp2_cpu);
+    return 0;
 }
 
 static ssize_t mp2_write(struct file * file, const char __user * ubuf, size_t size, loff_t * pos)
@@ -328,7 +822,7 @@ static ssize_t mp2_write(struct file * file, const char __user * ubuf, size_t si
 
     switch(m){
     case 'R':
-        if (registration(pid, period, computation_time))
+        if (registration(pid, period, computation_time, NULL, NULL) < 0)
         {
             printk(KERN_ALERT "registration failed\n");
         }
@@ -352,80 +846,226 @@ static ssize_t mp2_write(struct file * file, const char __user * ubuf, size_t si
     return (ssize_t)size;
 }
 
+static int mp2_dev_open(struct inode * inode, struct file * file)
+{
+    file->private_data = NULL;
+    return 0;
+}
+
+/* note: a process that exits without deregistering is deregistered when its file is closed */
+static int mp2_dev_release(struct inode * inode, struct file * file)
+{
+    struct mp2_cpu * mp2_cpu = NULL;
+
+    mutex_lock(&process_list_mutex);
+    if (file->private_data != NULL) mp2_cpu = deregister_entry(file->private_data);
+    mutex_unlock(&process_list_mutex);
+    if (mp2_cpu != NULL) request_dispatch(mp2_cpu);
+    return 0;
+}
+
+static long mp2_dev_ioctl(struct file * file, unsigned int cmd, unsigned long arg)
+{
+    struct mp2_register_args args;
+    struct mp2_process_entry * tmp;
+    struct mp2_cpu * mp2_cpu;
+    unsigned long pid;
+    ktime_t release = ktime_set(0, 0);
+    int ret;
+
+    switch (cmd) {
+    case MP2_IOC_REGISTER:
+        if (copy_from_user(&args, (void __user *)arg, sizeof(args))) return -EFAULT;
+        if (args.pid < 0) return -EINVAL;
+        ret = registration(args.pid ? args.pid : task_pid_vnr(current), args.period, args.comp_time, file, &release);
+        if (ret < 0) return ret;
+        args.cpu = ret;
+        args.release_ns = ktime_to_ns(release);
+        if (copy_to_user((void __user *)arg, &args, sizeof(args))) return -EFAULT;
+        return 0;
+    case MP2_IOC_YIELD:
+        /* note: the entry is bound to the file, no parsing and no lookup */
+        rcu_read_lock();
+        tmp = READ_ONCE(file->private_data);
+        ret = -ENOENT;
+        if (tmp != NULL)
+        {
+            pid = tmp->pid;
+            mp2_cpu = mp2_cpu_of(tmp);
+            ret = yield_entry(mp2_cpu, tmp);
+            /* note: nothing moves the next release before it happens */
+            release = tmp->release_time;
+        }
+        rcu_read_unlock();
+        if (ret < 0) return -ENOENT;
+        yield_sleep(mp2_cpu, pid, ret);
+        /* note: only after the sleep, a fault before it would leave the process runnable */
+        if (arg && put_user((u64)ktime_to_ns(release), (u64 __user *)arg)) return -EFAULT;
+        return 0;
+    case MP2_IOC_DEREGISTER:
+        mutex_lock(&process_list_mutex);
+        if (file->private_data == NULL)
+        {
+            mutex_unlock(&process_list_mutex);
+            return -ENOENT;
+        }
+        mp2_cpu = deregister_entry(file->private_data);
+        mutex_unlock(&process_list_mutex);
+        request_dispatch(mp2_cpu);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
 static int dispatching_func(void * data)
 {
-    struct list_head *pos, *q;
-    struct mp2_process_entry *tmp;
-    long shortest_period;
+    struct mp2_cpu * mp2_cpu = data;
     struct mp2_process_entry * highest_task;
+    struct mp2_process_entry * running;
+    struct rb_node * node;
     struct sched_param sparam_sleep, sparam_wake;
-    
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
 
-    /* section: run 1 iteration per wake */
-    while(!kthread_should_stop())
+    /* section: run 1 iteration per dispatch request */
+    for (;;)
     {
+        /* note: the state is set before the request is checked, a request made in between wakes us up again */
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop()) break;
+        if (!atomic_xchg(&mp2_cpu->dispatch_requested, 0))
+        {
+            schedule();
+            continue;
+        }
+        __set_current_state(TASK_RUNNING);
+
         printk(KERN_ALERT "dspch: activated\n");
         /* note: thread is awaked */
 
-        /* section: find the process which has largest priority */
-        shortest_period = ULONG_MAX;
-        highest_task = NULL;
-
-        mutex_lock(&process_list_mutex);
-        list_for_each_safe(pos, q, &mp2_process_entries)
+        /* section: move the released processes into the ready queue */
+        /** note: no process_list_mutex, a dispatch never waits for a registration or a stats reader.
+         * rcu_read_lock() keeps running and highest_task from being freed for the whole iteration;
+         * set_task_state(), wake_up_process() and sched_setscheduler() do not sleep. **/
+        rcu_read_lock();
+        drain_release_queue(mp2_cpu);
+        /* note: deregistration clears running_process under the same lock */
+        spin_lock(&mp2_cpu->ready_queue_lock);
+        running = mp2_cpu->running_process;
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        /* section: enforce the budget of the running process */
+        if (running != NULL && atomic_xchg(&running->budget_exhausted, 0))
         {
-            tmp = list_entry(pos, struct mp2_process_entry, ptrs);
-            if (tmp->state == TASK_RUNNING)
-            {
-                /* section: sellect a highest priority process from all runnable processes */
-                if (tmp->period < shortest_period)
-                {
-                    shortest_period = tmp->period;
-                    highest_task = tmp;
-                }
-            }
+            handle_overrun(mp2_cpu, running);
         }
-        mutex_unlock(&process_list_mutex);
+
+        /* section: find the process which has largest priority */
+        /* note: the leftmost node of the ready queue is the runnable process with the shortest period */
+        spin_lock(&mp2_cpu->ready_queue_lock);
+        node = mp2_core_queue_first(&mp2_cpu->ready_queue);
+        highest_task = node ? rb_entry(node, struct mp2_process_entry, ready_node) : NULL;
+        spin_unlock(&mp2_cpu->ready_queue_lock);
 
         /* section: sleep the running process (if any) */
-        if (running_process != NULL && find_task_by_pid((unsigned int)running_process->pid) != NULL)
+        if (running != NULL && mp2_task_alive(running))
         {
+            charge_budget(running, ktime_get());
             sparam_sleep.sched_priority = 0;
-            sched_setscheduler(running_process->linux_task, SCHED_NORMAL, &sparam_sleep);
-            printk(KERN_ALERT "dspch: stopping process pid %ld\n", running_process->pid);
-            set_task_state(running_process->linux_task, TASK_INTERRUPTIBLE);
-            running_process = NULL;
+            sched_setscheduler(running->linux_task, SCHED_NORMAL, &sparam_sleep);
+            printk(KERN_ALERT "dspch %u: stopping process pid %ld\n", mp2_cpu->cpu, running->pid);
+            set_task_state(running->linux_task, TASK_INTERRUPTIBLE);
         }
         /* section: wake up the ready process (if any) */
+        /** note: a process deregistered since it was picked is unhashed, skip it. otherwise
+         * its budget timer is armed and it becomes running_process under the lock, so that
+         * deregistration cancels the timer and clears running_process after this. **/
+        spin_lock(&mp2_cpu->ready_queue_lock);
+        if (highest_task != NULL && hlist_unhashed(&highest_task->pid_node)) highest_task = NULL;
         if (highest_task != NULL)
+        {
+            /* note: the first dispatch of a job ends its release to dispatch latency */
+            if (!highest_task->job_dispatched)
+            {
+                highest_task->job_dispatched = 1;
+                this_cpu_inc(highest_task->stats->latency[mp2_hist_bucket(ktime_to_ns(ktime_sub(ktime_get(), highest_task->release_time)))]);
+            }
+            /* note: the budget timer is armed for the time the job may still run */
+            if (mp2_overrun != MP2_OVERRUN_NONE)
+            {
+                highest_task->dispatched_at = ktime_get();
+                hrtimer_start(&highest_task->budget_timer, ktime_add_ns(highest_task->dispatched_at, highest_task->budget), HRTIMER_MODE_ABS);
+            }
+        }
+        mp2_cpu->running_process = highest_task;
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        if (highest_task != NULL && mp2_task_alive(highest_task))
         {
             wake_up_process(highest_task->linux_task);
-            sparam_wake.sched_priority = 99;
+            sparam_wake.sched_priority = MP2_PROCESS_PRIORITY;
             sched_setscheduler(highest_task->linux_task, SCHED_FIFO, &sparam_wake);
-            running_process = highest_task;
-            printk(KERN_ALERT "dspch: waking process pid %lu\n", highest_task->pid);
+            printk(KERN_ALERT "dspch %u: waking process pid %lu\n", mp2_cpu->cpu, highest_task->pid);
         }
-
-        set_current_state(TASK_INTERRUPTIBLE);
-        schedule();        
+        rcu_read_unlock();
     }
+    __set_current_state(TASK_RUNNING);
     return 0;
 }
 
+static void mp2_stop_dispatchers(void)
+{
+    struct mp2_cpu * mp2_cpu;
+    unsigned int cpu;
+
+    for_each_cpu(cpu, &mp2_cpumask)
+    {
+        mp2_cpu = per_cpu_ptr(&mp2_cpus, cpu);
+        if (mp2_cpu->dispatching_thread != NULL)
+        {
+            kthread_stop(mp2_cpu->dispatching_thread);
+            mp2_cpu->dispatching_thread = NULL;
+        }
+    }
+}
+
 int __init mp2_init(void)
 {
+    struct mp2_cpu * mp2_cpu;
+    struct sched_param sparam;
+    unsigned int cpu;
+
     #ifdef DEBUG
     //printk(KERN_ALERT "MP1 MODULE LOADING\n");
     #endif
 
     /* section: initialization */
     input_str = NULL;
-
-    /* section: create target proc file */
-    mp2_dir = proc_mkdir("mp2", NULL);
-    mp2_proc = proc_create("status", 0777, mp2_dir, &mp2_fops);
+    if (!strcmp(policy, "edf"))
+    {
+        mp2_policy = MP2_POLICY_EDF;
+    }
+    else if (strcmp(policy, "rm"))
+    {
+        printk(KERN_ALERT "unknown policy %s\n", policy);
+        return -EINVAL;
+    }
+    if (!strcmp(overrun, "none"))
+    {
+        mp2_overrun = MP2_OVERRUN_NONE;
+    }
+    else if (!strcmp(overrun, "cbs"))
+    {
+        /* note: a postponed deadline only lowers the priority of a process under edf */
+        if (mp2_policy != MP2_POLICY_EDF)
+        {
+            printk(KERN_ALERT "overrun=cbs needs policy=edf\n");
+            return -EINVAL;
+        }
+        mp2_overrun = MP2_OVERRUN_CBS;
+    }
+    else if (strcmp(overrun, "suspend"))
+    {
+        printk(KERN_ALERT "unknown overrun handling %s\n", overrun);
+        return -EINVAL;
+    }
 
     /* section: create slab */
     mp2_process_entries_slab = kmem_cache_create("mp2_process_struct slab", sizeof(struct mp2_process_entry), 0, SLAB_HWCACHE_ALIGN, NULL);
@@ -436,8 +1076,49 @@ int __init mp2_init(void)
     mp2_process_entries.next = &mp2_process_entries;
     mp2_process_entries.prev = &mp2_process_entries;
 
-    /* section: create kernel thread to conduct context switch */
-    dispatching_thread = kthread_run(dispatching_func, NULL, "context switch thread");
+    /* section: create one kernel thread per CPU to conduct context switch */
+    /* note: CPUs that come online later are not used */
+    cpumask_copy(&mp2_cpumask, cpu_online_mask);
+    for_each_cpu(cpu, &mp2_cpumask)
+    {
+        mp2_cpu = per_cpu_ptr(&mp2_cpus, cpu);
+        memset(mp2_cpu, 0, sizeof(struct mp2_cpu));
+        mp2_cpu->cpu = cpu;
+        mp2_core_queue_init(&mp2_cpu->ready_queue);
+        spin_lock_init(&mp2_cpu->ready_queue_lock);
+        init_llist_head(&mp2_cpu->release_queue);
+        atomic_set(&mp2_cpu->dispatch_requested, 0);
+    }
+    for_each_cpu(cpu, &mp2_cpumask)
+    {
+        mp2_cpu = per_cpu_ptr(&mp2_cpus, cpu);
+        mp2_cpu->dispatching_thread = kthread_create(dispatching_func, mp2_cpu, "context switch thread/%u", cpu);
+        if (IS_ERR(mp2_cpu->dispatching_thread))
+        {
+            mp2_cpu->dispatching_thread = NULL;
+            mp2_stop_dispatchers();
+            kmem_cache_destroy(mp2_process_entries_slab);
+            return -ENOMEM;
+        }
+        kthread_bind(mp2_cpu->dispatching_thread, cpu);
+        /* note: above the processes it dispatches, so that a release preempts the running one */
+        sparam.sched_priority = MP2_DISPATCHER_PRIORITY;
+        sched_setscheduler(mp2_cpu->dispatching_thread, SCHED_FIFO, &sparam);
+        wake_up_process(mp2_cpu->dispatching_thread);
+    }
+
+    /* section: create the command channels */
+    /* note: after the dispatchers, a registration may request a dispatch right away */
+    if (misc_register(&mp2_dev))
+    {
+        printk(KERN_ALERT "unable to register /dev/mp2\n");
+        mp2_stop_dispatchers();
+        kmem_cache_destroy(mp2_process_entries_slab);
+        return -ENODEV;
+    }
+    mp2_dir = proc_mkdir("mp2", NULL);
+    mp2_proc = proc_create("status", 0777, mp2_dir, &mp2_fops);
+    mp2_stats_proc = proc_create("stats", 0444, mp2_dir, &mp2_stats_fops);
 
     printk(KERN_ALERT "MP2 MODULE LOADED\n");
     return 0;
@@ -447,7 +1128,17 @@ void __exit mp2_exit(void)
 {
     struct list_head *pos, *q;
     struct mp2_process_entry *tmp;
+    struct mp2_cpu * mp2_cpu;
+    unsigned int cpu;
     
+    /* section: remove target proc file */
+    /* note: first, so that no write can register a process or use input_str while they are torn down */
+    printk(KERN_ALERT "removing 'status'");
+	remove_proc_entry("stats", mp2_dir);
+	remove_proc_entry("status", mp2_dir);
+    printk(KERN_ALERT "removing 'mp2'");
+	remove_proc_entry("mp2", NULL);
+
     /* section: free global pointers */
 	if (input_str != NULL)
 	{
@@ -456,32 +1147,60 @@ void __exit mp2_exit(void)
 		input_str = NULL;
 	}
 
-    /* section: stop all timers and deregistrate all processes */
+    /* note: the module cannot be unloaded while /dev/mp2 is open, so no entry is bound to a file */
+    misc_deregister(&mp2_dev);
+
+    /* section: stop all timers */
     mutex_lock(&process_list_mutex);
     list_for_each_safe(pos, q, &mp2_process_entries)
     {
         tmp = list_entry(pos, struct mp2_process_entry, ptrs);
         printk(KERN_ALERT "delete timer of PID %ld", tmp->pid);
-        del_timer_sync(&tmp->wakeup_timer);
+        /* note: unhashed first, so that a late yield does not arm the timer again */
+        mp2_cpu = mp2_cpu_of(tmp);
+        spin_lock(&mp2_cpu->ready_queue_lock);
+        hash_del_rcu(&tmp->pid_node);
+        if (mp2_cpu->running_process == tmp) mp2_cpu->running_process = NULL;
+        spin_unlock(&mp2_cpu->ready_queue_lock);
+        hrtimer_cancel(&tmp->wakeup_timer);
+        hrtimer_cancel(&tmp->budget_timer);
+    }
+    mutex_unlock(&process_list_mutex);
+
+    /* section: delete context switch threads */
+    /* note: after the timers, which wake them up, and before the entries they dispatch are freed */
+    mp2_stop_dispatchers();
+
+    /* section: deregistrate all processes */
+    mutex_lock(&process_list_mutex);
+    /* note: drop the queued releases before their entries are freed */
+    for_each_cpu(cpu, &mp2_cpumask)
+    {
+        llist_del_all(&per_cpu_ptr(&mp2_cpus, cpu)->release_queue);
+    }
+    list_for_each_safe(pos, q, &mp2_process_entries)
+    {
+        tmp = list_entry(pos, struct mp2_process_entry, ptrs);
         printk(KERN_ALERT "delete entry PID %ld", tmp->pid);
+        /* note: a dispatcher may have armed it again before it stopped */
+        hrtimer_cancel(&tmp->budget_timer);
+        mp2_cpu = mp2_cpu_of(tmp);
+        spin_lock(&mp2_cpu->ready_queue_lock);
+        ready_queue_erase(mp2_cpu, tmp);
+        spin_unlock(&mp2_cpu->ready_queue_lock);
         list_del(pos);
-        kmem_cache_free(mp2_process_entries_slab, tmp);
+        mp2_cpu->total_utilization -= tmp->utilization;
+        mp2_cpu->nr_processes--;
+        call_rcu(&tmp->rcu, mp2_free_entry);
     }
     mutex_unlock(&process_list_mutex);
-
-    /* section: delete context switch thread */
-    kthread_stop(dispatching_thread);
+    /* note: wait for the entries to be freed before their slab is destroyed */
+    rcu_barrier();
 
     /* section: destroy slab */
     printk(KERN_ALERT "destroy slab\n");
     kmem_cache_destroy(mp2_process_entries_slab);
 
-    /* section: remove target proc file */
-    printk(KERN_ALERT "removing 'status'");
-	remove_proc_entry("status", mp2_dir);
-    printk(KERN_ALERT "removing 'mp2'");
-	remove_proc_entry("mp2", NULL);
-
     printk(KERN_ALERT "MP2 MODULE UNLOADED\n");
 }
 
@@ -0,0 +1,211 @@
+#ifndef __MP2_CORE_INCLUDE__
+#define __MP2_CORE_INCLUDE__
+
+/** note: scheduling core of mp2, shared by the module and the userspace simulator.
+ * it holds the admission tests, the dispatch order and the ready queue, and nothing
+ * that depends on the kernel beyond the rbtree api, which mp2_rbtree.h provides to
+ * userspace. periods and computation times may be in any unit as long as both use
+ * the same one: the module uses ms, mp2_sim uses us. **/
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/rbtree.h>
+#define mp2_core_div(a, b) div64_u64(a, b)
+#define mp2_core_sort(base, n, size, cmp) sort(base, n, size, cmp, NULL)
+#else
+#include <stdint.h>
+#include <stdlib.h>
+#include "mp2_rbtree.h"
+typedef uint64_t u64;
+typedef int64_t s64;
+#define mp2_core_div(a, b) ((a) / (b))
+#define mp2_core_sort(base, n, size, cmp) qsort(base, n, size, cmp)
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+#endif
+
+/* note: utilizations are fixed point, in parts per million */
+#define MP2_UTIL_SCALE 1000000UL
+/* note: ln 2, the Liu & Layland bound for large task sets */
+#define MP2_LL_BOUND_LIMIT 693147UL
+
+#define MP2_POLICY_RM 0
+#define MP2_POLICY_EDF 1
+
+/* note: results of mp2_core_bound_test() */
+#define MP2_CORE_ADMIT 0
+#define MP2_CORE_REJECT 1
+#define MP2_CORE_EXACT 2
+
+/* note: one task of the set checked by the exact admission test */
+struct mp2_core_task {
+    unsigned long pid;
+    unsigned long period;
+    unsigned long comp_time;
+    unsigned long utilization;
+};
+
+/* note: Liu & Layland bound n(2^(1/n) - 1) for n = 1..16 tasks */
+static const unsigned long mp2_ll_bound[] = {
+    1000000, 828427, 779763, 756828, 743491, 734772, 728626, 724061,
+    720537, 717734, 715451, 713557, 711958, 710592, 709411, 708380
+};
+
+/* note: comp_time / period, rounded up */
+static inline unsigned long mp2_core_utilization(unsigned long period, unsigned long comp_time)
+{
+    return (unsigned long)mp2_core_div((u64)comp_time * MP2_UTIL_SCALE + period - 1, (u64)period);
+}
+
+/** note: the O(1) part of admission control, for a CPU whose n tasks including the
+ * new one have a total utilization of total. under edf, with deadlines equal to
+ * periods, the utilization test is exact. under rm the Liu & Layland bound is only
+ * sufficient: above it and up to one full CPU, MP2_CORE_EXACT asks the caller
+ * for mp2_core_exact_test(), unless exact is off. **/
+static inline int mp2_core_bound_test(int policy, unsigned long total, unsigned int n, int exact)
+{
+    unsigned long bound = n <= ARRAY_SIZE(mp2_ll_bound) ? mp2_ll_bound[n - 1] : MP2_LL_BOUND_LIMIT;
+
+    if (policy == MP2_POLICY_EDF) return total > MP2_UTIL_SCALE ? MP2_CORE_REJECT : MP2_CORE_ADMIT;
+    if (total <= bound) return MP2_CORE_ADMIT;
+    /* note: nothing above one CPU is schedulable */
+    if (total > MP2_UTIL_SCALE || !exact) return MP2_CORE_REJECT;
+    return MP2_CORE_EXACT;
+}
+
+/* note: rate-monotonic priority order, shorter period first, ties broken by pid like the ready queue */
+static int mp2_core_task_cmp(const void * a, const void * b)
+{
+    const struct mp2_core_task * x = a;
+    const struct mp2_core_task * y = b;
+
+    if (x->period != y->period) return x->period < y->period ? -1 : 1;
+    if (x->pid != y->pid) return x->pid < y->pid ? -1 : 1;
+    return 0;
+}
+
+/** note: exact rm test for a task set whose utilization is above the Liu & Layland
+ * bound but at most 1. the hyperbolic bound and the harmonic period test are
+ * tried first since they are cheaper; both are sufficient only. response time
+ * analysis then decides: the set is schedulable iff every worst case response
+ * time R_i = C_i + sum_{j < i} ceil(R_i / T_j) C_j is within the period T_i.
+ * tasks may be reordered. returns 0 if the set is schedulable, otherwise
+ * i + 1 for the first task i whose response time exceeds its period. **/
+static int mp2_core_exact_test(struct mp2_core_task * tasks, unsigned int n)
+{
+    unsigned int i, j;
+    u64 hyperbolic = MP2_UTIL_SCALE;
+    unsigned long response, next;
+
+    /* section: hyperbolic bound, prod(U_i + 1) <= 2 */
+    for (i = 0; i < n && hyperbolic <= 2 * MP2_UTIL_SCALE; i++)
+    {
+        hyperbolic = mp2_core_div(hyperbolic * (MP2_UTIL_SCALE + tasks[i].utilization) + MP2_UTIL_SCALE - 1, (u64)MP2_UTIL_SCALE);
+    }
+    if (hyperbolic <= 2 * MP2_UTIL_SCALE) return 0;
+
+    mp2_core_sort(tasks, n, sizeof(struct mp2_core_task), mp2_core_task_cmp);
+
+    /* section: harmonic periods, if each period divides the next one, U <= 1 is exact */
+    for (i = 1; i < n; i++)
+    {
+        if (tasks[i].period % tasks[i - 1].period) break;
+    }
+    if (i == n) return 0;
+
+    /* section: response time analysis */
+    for (i = 0; i < n; i++)
+    {
+        response = 0;
+        for (j = 0; j <= i; j++) response += tasks[j].comp_time;
+        while (response <= tasks[i].period)
+        {
+            next = tasks[i].comp_time;
+            for (j = 0; j < i; j++) next += DIV_ROUND_UP(response, tasks[j].period) * tasks[j].comp_time;
+            if (next == response) break;
+            response = next;
+        }
+        if (response > tasks[i].period) return i + 1;
+    }
+    return 0;
+}
+
+/** note: dispatch order, whether job a goes before job b. under rm the shorter
+ * period, under edf the earlier absolute deadline. ties are broken by pid. **/
+static inline int mp2_core_before(int policy, s64 deadline_a, unsigned long period_a, unsigned long pid_a,
+                                  s64 deadline_b, unsigned long period_b, unsigned long pid_b)
+{
+    if (policy == MP2_POLICY_EDF)
+    {
+        if (deadline_a != deadline_b) return deadline_a < deadline_b;
+    }
+    else if (period_a != period_b)
+    {
+        return period_a < period_b;
+    }
+    return pid_a < pid_b;
+}
+
+/** note: ready queue, an rbtree in dispatch order whose leftmost node is cached,
+ * so that the next job is picked in O(1). the module keeps one per CPU under its
+ * ready_queue_lock, mp2_sim one per simulated CPU. **/
+struct mp2_core_queue {
+    struct rb_root root;
+    struct rb_node * leftmost;
+};
+
+/* note: before(a, b) is whether node a goes before node b, see mp2_core_before() */
+typedef int (*mp2_core_before_fn)(const struct rb_node * a, const struct rb_node * b);
+
+static inline void mp2_core_queue_init(struct mp2_core_queue * queue)
+{
+    queue->root = RB_ROOT;
+    queue->leftmost = NULL;
+}
+
+/* note: the key of a queued node must not change until it is erased */
+static inline void mp2_core_queue_insert(struct mp2_core_queue * queue, struct rb_node * node, mp2_core_before_fn before)
+{
+    struct rb_node **link = &queue->root.rb_node;
+    struct rb_node *parent = NULL;
+    int leftmost = 1;
+
+    /* section: find the place of the new node, higher priority goes left */
+    while (*link)
+    {
+        parent = *link;
+        if (before(node, parent))
+        {
+            link = &parent->rb_left;
+        }
+        else
+        {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+    rb_link_node(node, parent, link);
+    rb_insert_color(node, &queue->root);
+    if (leftmost) queue->leftmost = node;
+}
+
+static inline void mp2_core_queue_erase(struct mp2_core_queue * queue, struct rb_node * node)
+{
+    if (queue->leftmost == node) queue->leftmost = rb_next(node);
+    rb_erase(node, &queue->root);
+}
+
+/* note: the node to dispatch, NULL if the queue is empty */
+static inline struct rb_node * mp2_core_queue_first(const struct mp2_core_queue * queue)
+{
+    return queue->leftmost;
+}
+
+#endif
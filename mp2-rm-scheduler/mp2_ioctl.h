@@ -0,0 +1,32 @@
+#ifndef __MP2_IOCTL_INCLUDE__
+#define __MP2_IOCTL_INCLUDE__
+
+/** note: binary command channel of /dev/mp2, shared by the module and userspace.
+ * a process opens /dev/mp2 once and registers through MP2_IOC_REGISTER, which
+ * binds the file to its entry. MP2_IOC_YIELD and MP2_IOC_DEREGISTER then act on
+ * that entry directly, without any parsing or lookup. closing the file
+ * deregisters the process if it has not done so yet.
+ * release times are CLOCK_MONOTONIC in ns, as the module computes them:
+ * MP2_IOC_REGISTER returns the time the registration is counted from, the
+ * first job is released one period later. MP2_IOC_YIELD returns, in the __u64
+ * its argument points to, the release of the job that runs when it returns. **/
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MP2_DEVICE "/dev/mp2"
+#define MP2_IOC_MAGIC 'm'
+
+struct mp2_register_args {
+    __s32 pid;        /* 0 for the calling process */
+    __u32 period;     /* ms */
+    __u32 comp_time;  /* ms */
+    __u32 cpu;        /* out: the CPU the process is partitioned to */
+    __u64 release_ns; /* out: registration time, CLOCK_MONOTONIC */
+};
+
+#define MP2_IOC_REGISTER _IOWR(MP2_IOC_MAGIC, 1, struct mp2_register_args)
+#define MP2_IOC_YIELD _IOR(MP2_IOC_MAGIC, 2, __u64)
+#define MP2_IOC_DEREGISTER _IO(MP2_IOC_MAGIC, 3)
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef __MP2_RBTREE_INCLUDE__
+#define __MP2_RBTREE_INCLUDE__
+
+/** note: userspace red-black tree with the part of the <linux/rbtree.h> api that
+ * mp2_core.h uses, so that mp2_sim runs the ready queue of the module. nodes keep
+ * their parent and color in separate fields, and an empty node is its own parent
+ * like in the kernel. **/
+
+#include <stddef.h>
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node * rb_parent;
+    struct rb_node * rb_left;
+    struct rb_node * rb_right;
+    int rb_color;
+};
+
+struct rb_root {
+    struct rb_node * rb_node;
+};
+
+#define RB_ROOT (struct rb_root) { NULL }
+#define rb_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define RB_EMPTY_NODE(node) ((node)->rb_parent == (node))
+#define RB_CLEAR_NODE(node) ((node)->rb_parent = (node))
+
+static inline int rb_is_black(const struct rb_node * node)
+{
+    return node == NULL || node->rb_color == RB_BLACK;
+}
+
+/* note: puts v where u hangs, v may be NULL */
+static inline void rb_replace_child(struct rb_node * u, struct rb_node * v, struct rb_root * root)
+{
+    if (u->rb_parent == NULL) root->rb_node = v;
+    else if (u == u->rb_parent->rb_left) u->rb_parent->rb_left = v;
+    else u->rb_parent->rb_right = v;
+    if (v != NULL) v->rb_parent = u->rb_parent;
+}
+
+static inline void rb_rotate_left(struct rb_node * x, struct rb_root * root)
+{
+    struct rb_node * y = x->rb_right;
+
+    x->rb_right = y->rb_left;
+    if (y->rb_left != NULL) y->rb_left->rb_parent = x;
+    rb_replace_child(x, y, root);
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+static inline void rb_rotate_right(struct rb_node * x, struct rb_root * root)
+{
+    struct rb_node * y = x->rb_left;
+
+    x->rb_left = y->rb_right;
+    if (y->rb_right != NULL) y->rb_right->rb_parent = x;
+    rb_replace_child(x, y, root);
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+static inline void rb_link_node(struct rb_node * node, struct rb_node * parent, struct rb_node ** link)
+{
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    node->rb_color = RB_RED;
+    *link = node;
+}
+
+/* note: rebalances after rb_link_node() */
+static void rb_insert_color(struct rb_node * node, struct rb_root * root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = node->rb_parent) != NULL && parent->rb_color == RB_RED)
+    {
+        /* note: a red node is never the root, so gparent exists */
+        gparent = parent->rb_parent;
+        if (parent == gparent->rb_left)
+        {
+            uncle = gparent->rb_right;
+            if (!rb_is_black(uncle))
+            {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right)
+            {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_right(gparent, root);
+        }
+        else
+        {
+            uncle = gparent->rb_left;
+            if (!rb_is_black(uncle))
+            {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left)
+            {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->rb_node->rb_color = RB_BLACK;
+}
+
+/* note: node is the child that took the place of a black node, it may be NULL */
+static void rb_erase_color(struct rb_node * node, struct rb_node * parent, struct rb_root * root)
+{
+    struct rb_node * sibling;
+
+    while (node != root->rb_node && rb_is_black(node))
+    {
+        if (node == parent->rb_left)
+        {
+            sibling = parent->rb_right;
+            if (!rb_is_black(sibling))
+            {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right))
+            {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_right))
+            {
+                sibling->rb_left->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_right->rb_color = RB_BLACK;
+            rb_rotate_left(parent, root);
+        }
+        else
+        {
+            sibling = parent->rb_left;
+            if (!rb_is_black(sibling))
+            {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right))
+            {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_left))
+            {
+                sibling->rb_right->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_left->rb_color = RB_BLACK;
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+    }
+    if (node != NULL) node->rb_color = RB_BLACK;
+}
+
+static void rb_erase(struct rb_node * node, struct rb_root * root)
+{
+    struct rb_node *next = node, *child, *parent;
+    int color = node->rb_color;
+
+    if (node->rb_left == NULL || node->rb_right == NULL)
+    {
+        child = node->rb_left != NULL ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        rb_replace_child(node, child, root);
+    }
+    else
+    {
+        /* section: the successor takes the place and the color of node */
+        next = node->rb_right;
+        while (next->rb_left != NULL) next = next->rb_left;
+        color = next->rb_color;
+        child = next->rb_right;
+        if (next->rb_parent == node)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = next->rb_parent;
+            rb_replace_child(next, child, root);
+            next->rb_right = node->rb_right;
+            next->rb_right->rb_parent = next;
+        }
+        rb_replace_child(node, next, root);
+        next->rb_left = node->rb_left;
+        next->rb_left->rb_parent = next;
+        next->rb_color = node->rb_color;
+    }
+    if (color == RB_BLACK) rb_erase_color(child, parent, root);
+}
+
+static inline struct rb_node * rb_next(const struct rb_node * node)
+{
+    struct rb_node * parent;
+
+    if (node->rb_right != NULL)
+    {
+        node = node->rb_right;
+        while (node->rb_left != NULL) node = node->rb_left;
+        return (struct rb_node *)node;
+    }
+    while ((parent = node->rb_parent) != NULL && node == parent->rb_right) node = parent;
+    return parent;
+}
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mp2_core.h"
+
+/*
+ * mp2_sim - discrete-event simulator of the mp2 scheduling core
+ *
+ * generates task sets with UUniFast (UUniFast-discard on more than one CPU),
+ * partitions each set first fit with the admission tests of mp2_core.h, in the
+ * order the tasks register, and simulates every CPU with the dispatch order of
+ * mp2_core_before() in the ready queue of mp2_core.h. all tasks release their first job at time 0 and every job
+ * runs for exactly its computation time. times are in us, periods are whole ms
+ * like in the module. for every policy and total utilization per CPU it reports:
+ *   sched        ratio of task sets whose tasks are all admitted
+ *   miss_ratio   ratio of jobs that do not complete before their deadline
+ *   missed_sets  ratio of task sets with at least one missed deadline
+ *   admit_us     mean cost of admitting one task
+ *   dispatch_ns  mean cost of one dispatch decision on the ready queue
+ * tasks rejected by admission control still run, on the least loaded CPU,
+ * unless -a is given: then only admitted tasks run and no deadline may be missed.
+ */
+
+#define NR_POLICIES 2
+
+struct task {
+	unsigned long pid;
+	unsigned long period;      /* us */
+	unsigned long comp_time;   /* us */
+	unsigned long utilization;
+	unsigned int cpu;
+	int admitted;
+	/* note: simulation state. release is the release of the queued job, or the next one while idle */
+	u64 release;
+	u64 deadline;
+	u64 remaining;
+	struct rb_node ready_node;
+};
+
+struct heap {
+	unsigned int * items;
+	unsigned int n;
+	int (*before)(unsigned int a, unsigned int b);
+};
+
+struct result {
+	unsigned long sets;
+	unsigned long sched_sets;
+	unsigned long missed_sets;
+	u64 jobs;
+	u64 misses;
+	u64 admissions;
+	u64 decisions;
+	double admit_ns;
+	double dispatch_ns;
+};
+
+static const char * policy_names[NR_POLICIES] = { "rm", "edf" };
+
+static struct task * tasks = NULL;
+static unsigned int nr_tasks = 16;
+static unsigned int nr_cpus = 1;
+static int policy = MP2_POLICY_RM;
+static int exact = 1;
+static int admitted_only = 0;
+
+/* note: per CPU task lists, nr_tasks entries each */
+static unsigned int * cpu_members = NULL;
+static unsigned int * cpu_counts = NULL;
+static unsigned long * cpu_totals = NULL;
+static struct mp2_core_task * scratch = NULL;
+static unsigned int * release_items = NULL;
+static unsigned int * batch = NULL;
+
+static u64 rng_state = 0x2545f4914f6cdd1dULL;
+static double clock_overhead_ns = 0.0;
+
+/* section: helpers */
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* note: xorshift64*, so that a seed gives the same task sets everywhere */
+static double uniform(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void calibrate_clock(void)
+{
+	u64 start = now_ns();
+	int i;
+	for (i = 0; i < 100000; i++) now_ns();
+	clock_overhead_ns = (double)(now_ns() - start) / 100000;
+}
+
+/* note: ns since start, without the cost of reading the clock */
+static double elapsed_ns(u64 start)
+{
+	double ns = (double)(now_ns() - start) - clock_overhead_ns;
+	return ns > 0 ? ns : 0;
+}
+
+static void heap_push(struct heap * h, unsigned int x)
+{
+	unsigned int i = h->n++, parent;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!h->before(x, h->items[parent])) break;
+		h->items[i] = h->items[parent];
+		i = parent;
+	}
+	h->items[i] = x;
+}
+
+static unsigned int heap_pop(struct heap * h)
+{
+	unsigned int top = h->items[0], x = h->items[--h->n], i = 0, child;
+	while ((child = 2 * i + 1) < h->n) {
+		if (child + 1 < h->n && h->before(h->items[child + 1], h->items[child])) child++;
+		if (!h->before(h->items[child], x)) break;
+		h->items[i] = h->items[child];
+		i = child;
+	}
+	h->items[i] = x;
+	return top;
+}
+
+/* note: the order of the ready queue, like ready_queue_before() in the module */
+static int ready_before(const struct rb_node * a, const struct rb_node * b)
+{
+	const struct task * x = rb_entry(a, struct task, ready_node);
+	const struct task * y = rb_entry(b, struct task, ready_node);
+
+	return mp2_core_before(policy, (s64)x->deadline, x->period, x->pid,
+		(s64)y->deadline, y->period, y->pid);
+}
+
+/* note: the release timers of the module */
+static int release_before(unsigned int a, unsigned int b)
+{
+	if (tasks[a].release != tasks[b].release) return tasks[a].release < tasks[b].release;
+	return tasks[a].pid < tasks[b].pid;
+}
+
+/* section: task set generation */
+
+/* note: UUniFast, n utilizations summing to total. discarded while one is above 1 */
+static int generate(double total, unsigned long period_min, unsigned long period_max)
+{
+	double sum, next, u;
+	unsigned int i, tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		sum = total;
+		for (i = 0; i < nr_tasks; i++) {
+			if (i + 1 < nr_tasks) {
+				next = sum * pow(uniform(), 1.0 / (nr_tasks - i - 1));
+				u = sum - next;
+				sum = next;
+			}
+			else {
+				u = sum;
+			}
+			if (u > 1.0) break;
+			/* note: log-uniform periods in whole ms */
+			tasks[i].pid = i + 1;
+			tasks[i].period = (unsigned long)exp(log(period_min) + uniform() * (log(period_max + 1) - log(period_min)));
+			if (tasks[i].period > period_max) tasks[i].period = period_max;
+			tasks[i].period *= 1000;
+			tasks[i].comp_time = (unsigned long)llround(u * tasks[i].period);
+			if (tasks[i].comp_time == 0) tasks[i].comp_time = 1;
+			if (tasks[i].comp_time > tasks[i].period) tasks[i].comp_time = tasks[i].period;
+			tasks[i].utilization = mp2_core_utilization(tasks[i].period, tasks[i].comp_time);
+		}
+		if (i == nr_tasks) return 0;
+	}
+	return -1;
+}
+
+/* section: admission control, first fit like registration() */
+
+/* note: whether task i fits on cpu */
+static int admit(unsigned int i, unsigned int cpu)
+{
+	unsigned int j, n = cpu_counts[cpu];
+	int ret = mp2_core_bound_test(policy, cpu_totals[cpu] + tasks[i].utilization, n + 1, exact);
+
+	if (ret != MP2_CORE_EXACT) return ret == MP2_CORE_ADMIT;
+	for (j = 0; j < n; j++) {
+		struct task * t = &tasks[cpu_members[cpu * nr_tasks + j]];
+		scratch[j].pid = t->pid;
+		scratch[j].period = t->period;
+		scratch[j].comp_time = t->comp_time;
+		scratch[j].utilization = t->utilization;
+	}
+	scratch[n].pid = tasks[i].pid;
+	scratch[n].period = tasks[i].period;
+	scratch[n].comp_time = tasks[i].comp_time;
+	scratch[n].utilization = tasks[i].utilization;
+	return mp2_core_exact_test(scratch, n + 1) == 0;
+}
+
+static void assign(unsigned int i, unsigned int cpu)
+{
+	tasks[i].cpu = cpu;
+	cpu_members[cpu * nr_tasks + cpu_counts[cpu]++] = i;
+	cpu_totals[cpu] += tasks[i].utilization;
+}
+
+/* note: returns the number of rejected tasks */
+static unsigned int partition(struct result * r)
+{
+	unsigned int i, cpu, least, rejected = 0;
+	u64 start;
+
+	memset(cpu_counts, 0, nr_cpus * sizeof(unsigned int));
+	memset(cpu_totals, 0, nr_cpus * sizeof(unsigned long));
+	for (i = 0; i < nr_tasks; i++) {
+		start = now_ns();
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (admit(i, cpu)) break;
+		}
+		r->admit_ns += elapsed_ns(start);
+		r->admissions++;
+
+		tasks[i].admitted = cpu < nr_cpus;
+		if (tasks[i].admitted) assign(i, cpu);
+		else rejected++;
+	}
+
+	/* note: after admission, which must not see the rejected tasks */
+	for (i = 0; i < nr_tasks && !admitted_only; i++) {
+		if (tasks[i].admitted) continue;
+		least = 0;
+		for (cpu = 1; cpu < nr_cpus; cpu++) {
+			if (cpu_totals[cpu] < cpu_totals[least]) least = cpu;
+		}
+		assign(i, least);
+	}
+	return rejected;
+}
+
+/* section: simulation of one CPU */
+
+/** note: the running job is always the head of the ready queue, like the leftmost
+ * node the dispatcher picks. a job that does not complete before its deadline is a
+ * miss and releases the next one a full period later, like a yield in the module. **/
+static void simulate_cpu(unsigned int cpu, u64 horizon, struct result * r)
+{
+	struct mp2_core_queue ready;
+	struct heap released = { release_items, 0, release_before };
+	unsigned int i, k, n = 0, cur;
+	u64 now = 0, next, finish, start;
+
+	mp2_core_queue_init(&ready);
+	for (i = 0; i < cpu_counts[cpu]; i++) {
+		cur = cpu_members[cpu * nr_tasks + i];
+		tasks[cur].release = 0;
+		heap_push(&released, cur);
+	}
+
+	for (;;) {
+		next = released.n ? tasks[released.items[0]].release : UINT64_MAX;
+		if (mp2_core_queue_first(&ready) != NULL) {
+			cur = rb_entry(mp2_core_queue_first(&ready), struct task, ready_node) - tasks;
+			finish = now + tasks[cur].remaining;
+			if (finish <= next) {
+				if (finish > horizon) break;
+				now = finish;
+
+				/* section: the job yields, the next one is dispatched */
+				start = now_ns();
+				mp2_core_queue_erase(&ready, &tasks[cur].ready_node);
+				r->dispatch_ns += elapsed_ns(start);
+				r->decisions++;
+
+				r->jobs++;
+				if (now >= tasks[cur].deadline) {
+					r->misses++;
+					tasks[cur].release = now + tasks[cur].period;
+				}
+				else {
+					tasks[cur].release += tasks[cur].period;
+				}
+				heap_push(&released, cur);
+				continue;
+			}
+			tasks[cur].remaining -= next - now;
+		}
+		if (next >= horizon) break;
+		now = next;
+
+		/* section: release the jobs due now */
+		n = 0;
+		while (released.n && tasks[released.items[0]].release <= now) {
+			cur = heap_pop(&released);
+			tasks[cur].deadline = tasks[cur].release + tasks[cur].period;
+			tasks[cur].remaining = tasks[cur].comp_time;
+			batch[n++] = cur;
+		}
+
+		/* section: the dispatcher drains the releases into the ready queue and picks the head */
+		start = now_ns();
+		for (k = 0; k < n; k++) mp2_core_queue_insert(&ready, &tasks[batch[k]].ready_node, ready_before);
+		r->dispatch_ns += elapsed_ns(start);
+		r->decisions++;
+	}
+}
+
+static void run_set(struct result * r, u64 horizon)
+{
+	u64 misses = r->misses;
+	unsigned int cpu;
+
+	r->sets++;
+	if (partition(r) == 0) r->sched_sets++;
+	for (cpu = 0; cpu < nr_cpus; cpu++) simulate_cpu(cpu, horizon, r);
+	if (r->misses != misses) r->missed_sets++;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-n tasks] [-m cpus] [-s sets] [-u min:max:step] [-p min_ms:max_ms] [-t horizon_ms] [-P rm|edf] [-e 0|1] [-a] [-r seed]\n", name);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int sets = 100, set, step_index;
+	unsigned long period_min = 10, period_max = 1000, horizon_ms = 10000, seed = 1;
+	double util_min = 0.5, util_max = 1.0, util_step = 0.05, util;
+	int policies[NR_POLICIES] = { MP2_POLICY_RM, MP2_POLICY_EDF };
+	int nr_policies = NR_POLICIES, p, opt;
+	struct result r;
+
+	while ((opt = getopt(argc, argv, "n:m:s:u:p:t:P:e:ar:")) != -1) {
+		switch (opt) {
+		case 'n': nr_tasks = atoi(optarg); break;
+		case 'm': nr_cpus = atoi(optarg); break;
+		case 's': sets = atoi(optarg); break;
+		case 'u': if (sscanf(optarg, "%lf:%lf:%lf", &util_min, &util_max, &util_step) != 3) usage(argv[0]); break;
+		case 'p': if (sscanf(optarg, "%lu:%lu", &period_min, &period_max) != 2) usage(argv[0]); break;
+		case 't': horizon_ms = strtoul(optarg, NULL, 10); break;
+		case 'P':
+			nr_policies = 1;
+			if (!strcmp(optarg, "rm")) policies[0] = MP2_POLICY_RM;
+			else if (!strcmp(optarg, "edf")) policies[0] = MP2_POLICY_EDF;
+			else usage(argv[0]);
+			break;
+		case 'e': exact = atoi(optarg); break;
+		case 'a': admitted_only = 1; break;
+		case 'r': seed = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nr_tasks == 0 || nr_cpus == 0 || sets == 0 || util_min <= 0 || util_max > 1.0 || util_step <= 0
+		|| period_min == 0 || period_max < period_min || horizon_ms == 0) usage(argv[0]);
+
+	tasks = calloc(nr_tasks, sizeof(struct task));
+	cpu_members = calloc((size_t)nr_cpus * nr_tasks, sizeof(unsigned int));
+	cpu_counts = calloc(nr_cpus, sizeof(unsigned int));
+	cpu_totals = calloc(nr_cpus, sizeof(unsigned long));
+	scratch = calloc(nr_tasks, sizeof(struct mp2_core_task));
+	release_items = calloc(nr_tasks, sizeof(unsigned int));
+	batch = calloc(nr_tasks, sizeof(unsigned int));
+	if (!tasks || !cpu_members || !cpu_counts || !cpu_totals || !scratch || !release_items || !batch) {
+		perror("calloc");
+		return 1;
+	}
+	calibrate_clock();
+
+	printf("%u tasks, %u cpus, %u sets per point, periods %lu-%lu ms, horizon %lu ms, exact test %s\n",
+		nr_tasks, nr_cpus, sets, period_min, period_max, horizon_ms, exact ? "on" : "off");
+	printf("%-6s %5s %7s %11s %11s %9s %11s\n", "policy", "util", "sched", "miss_ratio", "missed_sets", "admit_us", "dispatch_ns");
+
+	/* section: every policy sees the same task sets */
+	for (p = 0; p < nr_policies; p++) {
+		policy = policies[p];
+		for (step_index = 0; (util = util_min + step_index * util_step) <= util_max + 1e-9; step_index++) {
+			memset(&r, 0, sizeof(r));
+			rng_state = (seed * 1000003ULL + step_index) | 1;
+			for (set = 0; set < sets; set++) {
+				if (generate(util * nr_cpus, period_min, period_max)) {
+					fprintf(stderr, "unable to generate a task set of utilization %.2f\n", util * nr_cpus);
+					return 1;
+				}
+				run_set(&r, (u64)horizon_ms * 1000);
+			}
+			printf("%-6s %5.2f %7.3f %11.6f %11.3f %9.2f %11.1f\n", policy_names[policy], util,
+				(double)r.sched_sets / r.sets,
+				r.jobs ? (double)r.misses / r.jobs : 0.0,
+				(double)r.missed_sets / r.sets,
+				r.admissions ? r.admit_ns / r.admissions / 1000.0 : 0.0,
+				r.decisions ? r.dispatch_ns / r.decisions : 0.0);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
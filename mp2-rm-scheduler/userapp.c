@@ -1,98 +1,311 @@
 #include "userapp.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mp2_ioctl.h"
 
-int main(int argc, char* argv[]) 
-{   
-    int period;
-    int comp_time;
-    int iteration;
-    
-    int pid = getpid();
-	FILE * fp;
-	char * line_buf = NULL;
-    char expected_buf[50];
-	size_t line_buf_size = 0;
-	ssize_t line_size;
-    ssize_t expected_size = 0;
-    int is_registered = 0;
-    struct timeval start_time, end_time;
-	int i, round;
-	unsigned long factorial = 1;
-
-    if (argc < 4)
-    {
-        printf("usage: [period] [computation_time] [number of job]\n");
-        return 0;
-    }
-    period = atoi(argv[1]);
-    comp_time = atoi(argv[2]);
-    iteration = atoi(argv[3]);
-	
-    /* section: register the process */
-    fp = fopen("/proc/mp2/status", "w");
-	fprintf(fp, "R, %d, %d, %d", pid, period, comp_time);
-    printf("R, %d, %d, %d", pid, period, comp_time);
+/*
+ * userapp - periodic workload generator for mp2
+ *
+ * reads a task set, one task per line: period_ms comp_time_ms [jobs]
+ * (blank lines and lines starting with '#' are skipped), and forks one
+ * process per task. each process registers through /dev/mp2 and runs its jobs
+ * as a self-timed busy loop: it spins until it has used a share (-u, default
+ * 90%) of comp_time of CPU time (CLOCK_THREAD_CPUTIME_ID), so preemption does
+ * not shorten a job. the rest is headroom: the module charges the wall time
+ * between dispatch and yield, and a job that uses up its budget is suspended or
+ * postponed (see the overrun parameter). between jobs it yields. for every job
+ * it records with clock_gettime(CLOCK_MONOTONIC):
+ *   latency   from the release to the return of the yield
+ *   response  from the release to the end of the job
+ *   miss      whether the job ended at or after its deadline
+ *   suspend   whether the job was suspended for an overrun
+ * nothing is printed while the jobs run. the records go into memory shared
+ * with the parent, which prints percentiles once every task has finished.
+ *
+ * release times are the ones of the module: each yield returns the release of
+ * the job it wakes up for, so the records follow it when an overrun or a miss
+ * moves a release.
+ */
+
+#define DEFAULT_JOBS 10
+/* note: percent of comp_time a job spins for */
+#define DEFAULT_USE 90
+#define MAX_TASKS 1024
+/* note: CPU time of one chunk of the busy loop between two clock reads */
+#define SPIN_CHUNK_NS 5000
+
+struct task {
+	unsigned long period;     /* ms */
+	unsigned long comp_time;  /* ms */
+	unsigned int jobs;
+	pid_t pid;
+	/* note: shared with the child, filled in by it */
+	struct record * record;
+	size_t record_size;
+};
+
+struct record {
+	int registered;
+	unsigned int cpu;
+	unsigned int jobs_done;
+	unsigned int misses;
+	unsigned int suspended;
+	uint64_t samples[];  /* jobs latencies, then jobs response times, ns */
+};
+
+static struct task tasks[MAX_TASKS];
+static int nr_tasks = 0;
+static unsigned long spin_chunk = 1000;
+static unsigned int use_percent = DEFAULT_USE;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin_iterations(unsigned long n)
+{
+	volatile unsigned long x = 0;
+	unsigned long i;
+	for (i = 0; i < n; i++) x += i;
+}
+
+/* note: iterations of the busy loop that take about SPIN_CHUNK_NS of CPU time */
+static void calibrate(void)
+{
+	uint64_t start, ns;
+	unsigned long n = 1000;
+
+	for (;;) {
+		start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		spin_iterations(n);
+		ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+		if (ns >= 10 * 1000000ULL) break;
+		n *= 2;
+	}
+	spin_chunk = n * SPIN_CHUNK_NS / ns;
+	if (spin_chunk == 0) spin_chunk = 1;
+}
+
+/* note: spin until ns of CPU time are used */
+static void spin(uint64_t ns)
+{
+	uint64_t end = clock_ns(CLOCK_THREAD_CPUTIME_ID) + ns;
+	while (clock_ns(CLOCK_THREAD_CPUTIME_ID) < end) spin_iterations(spin_chunk);
+}
+
+/* section: one periodic task, in its own process */
+static int run_task(struct task * task)
+{
+	struct record * record = task->record;
+	uint64_t * latency = record->samples;
+	uint64_t * response = record->samples + task->jobs;
+	uint64_t period_ns = task->period * 1000000ULL, work_ns = task->comp_time * 10000ULL * use_percent;
+	uint64_t release, next, wake, end;
+	struct mp2_register_args args;
+	unsigned int job;
+	int fd;
+
+	/* note: no page faults while the jobs run */
+	mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	fd = open(MP2_DEVICE, O_RDWR);
+	if (fd < 0) return 1;
+	memset(&args, 0, sizeof(args));
+	args.period = task->period;
+	args.comp_time = task->comp_time;
+	if (ioctl(fd, MP2_IOC_REGISTER, &args)) return 1;
+	record->registered = 1;
+	record->cpu = args.cpu;
+
+	/* note: the first yield waits for the first release, one period after args.release_ns */
+	if (ioctl(fd, MP2_IOC_YIELD, &release)) return 1;
+
+	/* section: jobs */
+	for (job = 0; job < task->jobs; job++) {
+		wake = clock_ns(CLOCK_MONOTONIC);
+		spin(work_ns);
+		end = clock_ns(CLOCK_MONOTONIC);
+
+		latency[job] = wake > release ? wake - release : 0;
+		response[job] = end - release;
+		if (end >= release + period_ns) record->misses++;
+		record->jobs_done = job + 1;
+		if (job + 1 == task->jobs) break;
+
+		if (ioctl(fd, MP2_IOC_YIELD, &next)) break;
+		/** note: the next release is one period later, unless the job was late. after a
+		 * miss yield_cpu() counts it from the yield, later than end + period. a job
+		 * suspended for an overrun resumed at a release it moved, the next one follows
+		 * that and is at most end + period. **/
+		if (next > release + period_ns && next <= end + period_ns) record->suspended++;
+		release = next;
+	}
+
+	ioctl(fd, MP2_IOC_DEREGISTER);
+	close(fd);
+	return 0;
+}
+
+/* section: report */
+
+static int cmp_u64(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* note: nearest rank percentile of n sorted samples, in us */
+static double percentile(const uint64_t * sorted, unsigned int n, double p)
+{
+	unsigned int rank;
+	if (n == 0) return 0.0;
+	rank = (unsigned int)(p / 100.0 * n + 0.999999);
+	if (rank < 1) rank = 1;
+	if (rank > n) rank = n;
+	return sorted[rank - 1] / 1000.0;
+}
+
+static void print_row(const char * name, unsigned int cpu, unsigned long period, unsigned long comp_time,
+	unsigned int jobs, unsigned int misses, unsigned int suspended, uint64_t * latency, uint64_t * response)
+{
+	qsort(latency, jobs, sizeof(uint64_t), cmp_u64);
+	qsort(response, jobs, sizeof(uint64_t), cmp_u64);
+	printf("%-8s %4d %7lu %7lu %6u %6u %6u %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		name, (int)cpu, period, comp_time, jobs, misses, suspended,
+		percentile(latency, jobs, 50), percentile(latency, jobs, 90), percentile(latency, jobs, 99), percentile(latency, jobs, 100),
+		percentile(response, jobs, 50), percentile(response, jobs, 90), percentile(response, jobs, 99), percentile(response, jobs, 100));
+}
+
+static void report(void)
+{
+	uint64_t * all_latency, * all_response;
+	unsigned int total_jobs = 0, total_misses = 0, total_suspended = 0, n;
+	char name[16];
+	int i;
+
+	for (i = 0; i < nr_tasks; i++) total_jobs += tasks[i].jobs;
+	all_latency = malloc((total_jobs + 1) * sizeof(uint64_t));
+	all_response = malloc((total_jobs + 1) * sizeof(uint64_t));
+	if (all_latency == NULL || all_response == NULL) {
+		perror("malloc");
+		return;
+	}
+
+	printf("%-8s %4s %7s %7s %6s %6s %6s %9s %9s %9s %9s %9s %9s %9s %9s\n", "pid", "cpu", "period", "comp",
+		"jobs", "misses", "susp", "lat_p50", "lat_p90", "lat_p99", "lat_max", "resp_p50", "resp_p90", "resp_p99", "resp_max");
+	total_jobs = 0;
+	for (i = 0; i < nr_tasks; i++) {
+		struct record * record = tasks[i].record;
+		n = record->jobs_done;
+		snprintf(name, sizeof(name), "%d", (int)tasks[i].pid);
+		if (!record->registered) {
+			printf("%-8s not registered (period %lu, comp_time %lu)\n", name, tasks[i].period, tasks[i].comp_time);
+			continue;
+		}
+		memcpy(all_latency + total_jobs, record->samples, n * sizeof(uint64_t));
+		memcpy(all_response + total_jobs, record->samples + tasks[i].jobs, n * sizeof(uint64_t));
+		total_jobs += n;
+		total_misses += record->misses;
+		total_suspended += record->suspended;
+		print_row(name, record->cpu, tasks[i].period, tasks[i].comp_time, n, record->misses, record->suspended,
+			record->samples, record->samples + tasks[i].jobs);
+	}
+	print_row("all", -1, 0, 0, total_jobs, total_misses, total_suspended, all_latency, all_response);
+	printf("times in us, periods and computation times in ms\n");
+	free(all_latency);
+	free(all_response);
+}
+
+/* section: task set file */
+static int read_task_set(const char * path, unsigned int default_jobs)
+{
+	FILE * fp = fopen(path, "r");
+	char line[256];
+	unsigned long period, comp_time;
+	unsigned int jobs;
+	int n, line_no = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line_no++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') continue;
+		jobs = default_jobs;
+		n = sscanf(line, "%lu %lu %u", &period, &comp_time, &jobs);
+		if (n < 2 || period == 0 || comp_time == 0 || comp_time > period || jobs == 0) {
+			fprintf(stderr, "%s:%d: expected period_ms comp_time_ms [jobs]\n", path, line_no);
+			fclose(fp);
+			return -1;
+		}
+		if (nr_tasks == MAX_TASKS) {
+			fprintf(stderr, "%s: more than %d tasks\n", path, MAX_TASKS);
+			fclose(fp);
+			return -1;
+		}
+		tasks[nr_tasks].period = period;
+		tasks[nr_tasks].comp_time = comp_time;
+		tasks[nr_tasks].jobs = jobs;
+		nr_tasks++;
+	}
 	fclose(fp);
+	return 0;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-j jobs] [-u use_percent] task_set_file\n", name);
+	fprintf(stderr, "  task_set_file: one task per line, period_ms comp_time_ms [jobs]\n");
+	fprintf(stderr, "  use_percent: share of comp_time each job spins for, default %d\n", DEFAULT_USE);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int default_jobs = DEFAULT_JOBS;
+	int opt, i, status;
+
+	while ((opt = getopt(argc, argv, "j:u:")) != -1) {
+		switch (opt) {
+		case 'j': default_jobs = atoi(optarg); break;
+		case 'u': use_percent = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || default_jobs == 0 || use_percent == 0 || use_percent > 100) usage(argv[0]);
+	if (read_task_set(argv[optind], default_jobs) || nr_tasks == 0) return 1;
+
+	calibrate();
 
-    /* section: check whether is success or not */
-    fp = fopen("/proc/mp2/status", "r");
-    if (fp == NULL) 
-    {
-        printf("errno: %d", errno);
-        return 0;
-    }
-	while (getline(&line_buf, &line_buf_size, fp) != EOF)
-	{
-		expected_size = sprintf(expected_buf, "%d %d %d", pid, period, comp_time);
-        if (strncmp(line_buf, expected_buf, expected_size) == 0)
-        {
-            is_registered = 1;
-            break;
-        }
+	/* section: shared records, touched before the fork so that the children do not fault on them */
+	for (i = 0; i < nr_tasks; i++) {
+		tasks[i].record_size = sizeof(struct record) + 2 * tasks[i].jobs * sizeof(uint64_t);
+		tasks[i].record = mmap(NULL, tasks[i].record_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (tasks[i].record == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+		memset(tasks[i].record, 0, tasks[i].record_size);
 	}
-    fclose(fp);
-    if (!is_registered)
-    {
-        printf("unable to register this process.\n");
-        return 0;
-    }
-
-    /* section: yield */
-    printf("go to sleep\n");
-
-    fp = fopen("/proc/mp2/status", "w");
-	fprintf(fp, "Y, %d", pid);
-    fclose(fp);
-
-    printf("wake up -------------- %d\n", pid);
-    system("cat /proc/uptime");
-
-    /* section: job */
-    for (round = 0; round < iteration; round++) 
-    {
-        /* section: start factorial computation */
-        gettimeofday(&start_time, NULL);
-        factorial = 1;
-        
-        for (i = 1; i < 50000 * comp_time; i++) 
-        {
-            factorial *= i;
-            gettimeofday(&end_time, NULL);
-        }
-
-        /* section: yield */
-        system("cat /proc/uptime");
-        printf("go to sleep ------------------ %d\n", pid);
-
-        fp = fopen("/proc/mp2/status", "w");
-	    fprintf(fp, "Y, %d", pid);
-        fclose(fp);
-
-        printf("wake up ------------------ %d\n", pid);
-        system("cat /proc/uptime");
-    }
-
-    fp = fopen("/proc/mp2/status", "w");
-	fprintf(fp, "D, %d", pid);
-	
-    return 0;
-}
\ No newline at end of file
+
+	/* section: one process per task */
+	for (i = 0; i < nr_tasks; i++) {
+		tasks[i].pid = fork();
+		if (tasks[i].pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (tasks[i].pid == 0) _exit(run_task(&tasks[i]));
+	}
+	for (i = 0; i < nr_tasks; i++) waitpid(tasks[i].pid, &status, 0);
+
+	report();
+	return 0;
+}